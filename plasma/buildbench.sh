@@ -0,0 +1,6 @@
+#!/bin/sh
+
+# Host build with the benchmarks compiled in; run as ./plasma-bench --bench-kernel
+# to compare the original cell-at-a-time field loop, the row kernel and the
+# Q16 kernel, or ./plasma-bench --check to test Q16 output against float
+gcc -O2 -DPLASMA_BENCH plasma.c -o plasma-bench -lm
@@ -1,15 +1,45 @@
 // Plasma Effect - Portable: POSIX & ESP32-S3 BreezyBox
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <time.h>
+#include <signal.h>
 
 #define TARGET_FPS   50
 #define BUF_SIZE     256
-#define CACHE_W      256
+#define MAX_COLS     4096   // Grid limit: keeps the Q16 kernel's distance^2 within 32 bits
+#define MAX_ROWS     2400
+#define DIFF_BRIDGE  8      // Consider rewriting up to this many unchanged cells rather than jump over them
+
+/* Q16 integer field kernel: default on the ESP32-S3, whose single-precision
+ * FPU makes sqrtf and float->int conversions the bulk of the frame */
+#ifndef FIELD_FIXED
+    #ifdef __XTENSA__
+        #define FIELD_FIXED 1
+    #else
+        #define FIELD_FIXED 0
+    #endif
+#endif
+
+/* Band workers: a pthread pool on POSIX. On the ESP32-S3 a task pinned to
+ * the second core, which needs the firmware to export the FreeRTOS task
+ * and notify calls, so there it is a build option (-DPLASMA_THREADS=1) */
+#ifndef PLASMA_THREADS
+    #ifdef __XTENSA__
+        #define PLASMA_THREADS 0
+    #else
+        #define PLASMA_THREADS 1
+    #endif
+#endif
+#ifdef __XTENSA__
+    #define MAX_WORKERS 1
+#else
+    #define MAX_WORKERS 8
+#endif
 
 #ifdef __XTENSA__
 
@@ -20,10 +50,25 @@
     void vterm_set_palette(const uint16_t *palette);
     void my_display_refresh_palette(void);
     const uint16_t *vterm_get_palette(void);
+    int64_t esp_timer_get_time(void);
 
     #define portTICK_PERIOD_MS  10
     #define pdMS_TO_TICKS(ms)   ((ms) / portTICK_PERIOD_MS)
 
+#if PLASMA_THREADS
+    typedef void *TaskHandle_t;
+    int xTaskCreatePinnedToCore(void (*fn)(void *), const char *name, uint32_t stack,
+                                void *arg, unsigned prio, TaskHandle_t *task, int core);
+    TaskHandle_t xTaskGetCurrentTaskHandle(void);
+    unsigned uxTaskPriorityGet(TaskHandle_t task);
+    uint32_t ulTaskGenericNotifyTake(unsigned index, int clear, TickType_t wait);
+    int xTaskGenericNotify(TaskHandle_t task, unsigned index, uint32_t value, int action, uint32_t *prev);
+    void vTaskDelete(TaskHandle_t task);
+
+    #define portMAX_DELAY       0xFFFFFFFF
+    #define eIncrement          2
+#endif
+
     static const uint16_t PLASMA_PALETTE[16] = {
         0x0000, 0xF800, 0xD000, 0xFC20, 0xFFE0, 0xFEA0, 0x07E0, 0x0560,
         0x057F, 0x02FF, 0x801F, 0x581F, 0xF81F, 0xD015, 0xFD75, 0xFEB5
@@ -34,6 +79,11 @@
         "\033[90m", "\033[91m", "\033[92m", "\033[93m", "\033[94m", "\033[95m", "\033[96m", "\033[97m"
     };
 
+    static const char *s_bg_map[16] = {
+        "\033[41m", "\033[42m", "\033[43m", "\033[43m", "\033[44m", "\033[45m", "\033[46m", "\033[47m",
+        "\033[100m", "\033[101m", "\033[102m", "\033[103m", "\033[104m", "\033[105m", "\033[106m", "\033[107m"
+    };
+
     static uint16_t s_old_palette[16];
     static int s_orig_fcntl;
     static TickType_t s_last_wake;
@@ -57,15 +107,38 @@
         fcntl(STDIN_FILENO, F_SETFL, s_orig_fcntl);
     }
 
-    static void plat_get_size(int *rows, int *cols) { vterm_get_size(rows, cols); }
+    static int s_size_rows, s_size_cols;
+
+    static void plat_get_size(int *rows, int *cols) {
+        vterm_get_size(rows, cols);
+        s_size_rows = *rows; s_size_cols = *cols;
+    }
+
+    /* The console has no resize signal; compare sizes once a frame */
+    static int plat_take_resize(void) {
+        int rows, cols;
+        vterm_get_size(&rows, &cols);
+        return rows != s_size_rows || cols != s_size_cols;
+    }
 
     static void plat_sync_frame(void) { vTaskDelayUntil(&s_last_wake, s_freq); }
 
+    static long long plat_time_us(void) { return esp_timer_get_time(); }
+
 #else /* POSIX / Mac */
     #include <sys/ioctl.h>
     #include <termios.h>
+#if PLASMA_THREADS
+    #include <pthread.h>
+#endif
 
     static struct termios s_orig_termios;
+    static volatile sig_atomic_t s_resized;
+
+    static void on_winch(int sig) {
+        (void)sig;
+        s_resized = 1;
+    }
 
     static const char *s_color_map[16] = {
         "\033[38;5;196m", "\033[38;5;160m", "\033[38;5;208m", "\033[38;5;208m",
@@ -74,6 +147,13 @@
         "\033[38;5;201m", "\033[38;5;163m", "\033[38;5;217m", "\033[38;5;223m"
     };
 
+    static const char *s_bg_map[16] = {
+        "\033[48;5;196m", "\033[48;5;160m", "\033[48;5;208m", "\033[48;5;208m",
+        "\033[48;5;226m", "\033[48;5;220m", "\033[48;5;46m",  "\033[48;5;34m",
+        "\033[48;5;39m",  "\033[48;5;27m",  "\033[48;5;93m",  "\033[48;5;57m",
+        "\033[48;5;201m", "\033[48;5;163m", "\033[48;5;217m", "\033[48;5;223m"
+    };
+
     static void plat_get_size(int *rows, int *cols) {
         struct winsize w;
         if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) == 0) {
@@ -88,42 +168,169 @@
         tcgetattr(STDIN_FILENO, &s_orig_termios);
         struct termios raw = s_orig_termios;
         raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+        raw.c_oflag &= ~OPOST;  // The encoder counts bytes; no \n -> \r\n expansion
         raw.c_cc[VMIN] = 0; raw.c_cc[VTIME] = 0;
         tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = on_winch;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGWINCH, &sa, NULL);
+    }
+
+    static int plat_take_resize(void) {
+        int r = s_resized;
+        s_resized = 0;
+        return r;
     }
 
     static void plat_cleanup(void) {
+        signal(SIGWINCH, SIG_DFL);
         tcsetattr(STDIN_FILENO, TCSANOW, &s_orig_termios);
         printf("\033[?25h"); // show cursor
     }
 
-    static void plat_sync_frame(void) { usleep(1000000 / TARGET_FPS); }
+    static long long s_deadline_us;
+
+    static long long plat_time_us(void) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+    }
+
+    /* Sleep to the next frame deadline, like vTaskDelayUntil: a slow frame
+     * shortens the wait. A frame more than a period late resets the
+     * schedule instead of bursting to catch up. */
+    static void plat_sync_frame(void) {
+        long long now = plat_time_us();
+        s_deadline_us += 1000000 / TARGET_FPS;
+        if (s_deadline_us < now - 1000000 / TARGET_FPS) s_deadline_us = now;
+        if (s_deadline_us > now) usleep(s_deadline_us - now);
+    }
 
 #endif // XTENSA / POSIX
 
 static char s_out_buf[BUF_SIZE];
 static int  s_buf_pos = 0;
+static long s_out_count = 0;    // Bytes pushed so far
+static int  s_count_only = 0;   // Measure a frame's cost without emitting it
+static int  s_out_fd = STDOUT_FILENO;   // -1: memory sink, flushes are dropped
 
 static void flush_buf(void) {
     if (s_buf_pos > 0) {
-        write(STDOUT_FILENO, s_out_buf, s_buf_pos);
+        if (s_out_fd >= 0) write(s_out_fd, s_out_buf, s_buf_pos);
         s_buf_pos = 0;
     }
 }
 
-static void push_str(const char *s) {
-    int len = strlen(s);
+static void push_bytes(const char *s, int len) {
+    s_out_count += len;
+    if (s_count_only) return;
     if (s_buf_pos + len >= BUF_SIZE) flush_buf();
     memcpy(&s_out_buf[s_buf_pos], s, len);
     s_buf_pos += len;
 }
 
+static void push_str(const char *s) { push_bytes(s, strlen(s)); }
+
 static void push_char(char c) {
+    s_out_count++;
+    if (s_count_only) return;
     if (s_buf_pos >= BUF_SIZE - 1) flush_buf();
     s_out_buf[s_buf_pos++] = c;
 }
 
-static void push_color(int i) { push_str(s_color_map[i & 0x0F]); }
+static void push_num(int n) {
+    char tmp[12];
+    int i = sizeof(tmp);
+    do { tmp[--i] = '0' + n % 10; n /= 10; } while (n);
+    while (i < (int)sizeof(tmp)) push_char(tmp[i++]);
+}
+
+/*
+ * Encoder options. REP (CSI n b) repeats the last glyph; most terminals
+ * have it, but not all, so it is opt-in. Blocks mode draws background
+ * colored spaces instead of colored letters.
+ */
+static int s_enc_rep = 0;
+static int s_enc_blocks = 0;
+static long s_budget = 0;       // Bytes per frame, 0: unlimited
+static long s_gov_budget = 0;   // The governor's, when it skips diffs; the lower one holds
+static int s_interlace = 0;     // Governor: send the changes of odd and even rows on alternate frames
+static int s_parity;
+
+/*
+ * Colors. The field is quantized to s_levels steps (16 << s_level_shift,
+ * at most 128 so a level never equals the 0xFF "unknown" cell); level j
+ * draws glyph CHARS[j >> s_level_shift]. In 16-color mode it takes the
+ * color of that glyph from s_color_map. In 256-color and truecolor mode
+ * the levels run along a gradient through the RGB of the xterm colors
+ * that the POSIX map uses, each quantized to what the mode can show.
+ * All escapes are formatted once, here, into s_esc.
+ */
+enum { COLORS_16, COLORS_256, COLORS_TRUE };
+#define MAX_LEVELS 128
+
+static int s_color_mode = COLORS_16;
+static int s_level_shift = 0;
+static int s_levels = 16;
+static const char *s_esc[MAX_LEVELS];
+static unsigned char s_esc_len[MAX_LEVELS];
+static int s_color_id[MAX_LEVELS];      // First level with the same escape
+static char s_esc_buf[MAX_LEVELS * 20];
+
+static const unsigned char s_gradient_xterm[16] = {
+    196, 160, 208, 208, 226, 220, 46, 34, 39, 27, 93, 57, 201, 163, 217, 223
+};
+
+static int xterm_level(int n) { return n ? 55 + n * 40 : 0; }
+
+static int cube_index(int v) { return v < 48 ? 0 : v < 115 ? 1 : (v - 35) / 40; }
+
+static void init_colors(void) {
+    const char **map = s_enc_blocks ? s_bg_map : s_color_map;
+    char *p = s_esc_buf;
+
+    s_levels = 16 << s_level_shift;
+    for (int j = 0; j < s_levels; j++) {
+        if (s_color_mode == COLORS_16) {
+            s_esc[j] = map[j >> s_level_shift];
+            s_esc_len[j] = strlen(s_esc[j]);
+            continue;
+        }
+
+        /* Interpolate between the two anchors around j */
+        int pos = j * 15, a = pos / (s_levels - 1), f = pos % (s_levels - 1);
+        int b = a < 15 ? a + 1 : a, rgb[3];
+        for (int k = 0; k < 3; k++) {
+            int ca = s_gradient_xterm[a] - 16, cb = s_gradient_xterm[b] - 16;
+            int va = xterm_level(k == 0 ? ca / 36 : k == 1 ? ca / 6 % 6 : ca % 6);
+            int vb = xterm_level(k == 0 ? cb / 36 : k == 1 ? cb / 6 % 6 : cb % 6);
+            rgb[k] = va + (vb - va) * f / (s_levels - 1);
+        }
+
+        int n;
+        if (s_color_mode == COLORS_256) {
+            n = sprintf(p, "\033[%d;5;%dm", s_enc_blocks ? 48 : 38,
+                        16 + 36 * cube_index(rgb[0]) + 6 * cube_index(rgb[1]) + cube_index(rgb[2]));
+        } else {
+            n = sprintf(p, "\033[%d;2;%d;%d;%dm", s_enc_blocks ? 48 : 38, rgb[0], rgb[1], rgb[2]);
+        }
+        s_esc[j] = p;
+        s_esc_len[j] = n;
+        p += n + 1;
+    }
+
+    for (int i = 0; i < s_levels; i++) {
+        s_color_id[i] = i;
+        for (int j = 0; j < i; j++) {
+            if (strcmp(s_esc[i], s_esc[j]) == 0) { s_color_id[i] = j; break; }
+        }
+    }
+}
+
+static void push_color(int i) { push_bytes(s_esc[i], s_esc_len[i]); }
 
 static int has_input_should_exit(void) {
     char c;
@@ -136,84 +343,1147 @@ static int has_input_should_exit(void) {
 
 static const char CHARS[] = "ABCDEFGHIJKLMNOP";
 static float s_sin_lut[SIN_SIZE];
-static float s_cache_x_val[CACHE_W];
-static float s_cache_x_sq[CACHE_W];
+#if !FIELD_FIXED || defined(PLASMA_BENCH)
+static float *s_cache_x_val, *s_cache_x_sq;
+#endif
+
+/* Row kernel scratch, one pass at a time; one per thread computing rows */
+typedef struct {
+#if !FIELD_FIXED || defined(PLASMA_BENCH)
+    float *val;
+    int   *idx;
+#else
+    int unused;
+#endif
+} row_scratch_t;
+
+static row_scratch_t s_scratch[MAX_WORKERS + 1];    // [0]: the main thread
+
+/*
+ * Frame diff: the field is rendered into s_back (one palette index per
+ * cell, which also selects the glyph), and only cells that differ from
+ * s_front, the grid the terminal is showing, are sent. The cursor and
+ * color the terminal was left with carry over between frames, and each
+ * move, gap and run goes out in whichever encoding is cheapest.
+ */
+static int s_rows, s_cols;
+static unsigned char *s_front, *s_back;
+static unsigned char *s_next;   // The frame after s_back, while workers compute it
+static int s_cursor = -1;       // Cell index the next glyph lands on, -1 unknown
+static int s_wrap = 0;          // Cursor sits past the end of a row, wrap pending
+static int s_cur_color = -1;    // s_color_id of the current SGR
+
+static int num_len(int n) {
+    int len = 1;
+    while (n >= 10) { n /= 10; len++; }
+    return len;
+}
+
+/* CSI n C, with n omitted when 1 */
+static int cuf_cost(int n) { return n == 0 ? 0 : n == 1 ? 3 : 3 + num_len(n); }
+
+static void push_cuf(int n) {
+    if (n == 0) return;
+    push_str("\033[");
+    if (n > 1) push_num(n);
+    push_char('C');
+}
+
+/*
+ * Move the cursor to cell by CUP, CUF along the row, or CR LF and CUF
+ * onto the next row, whichever is shortest. Relative moves need to know
+ * where the cursor really is: with a wrap pending it is still on the
+ * previous row's last column. Returns the cost; emits only if asked.
+ */
+static int push_goto(int cell, int emit) {
+    int y = cell / s_cols, x = cell % s_cols;
+    int cost = 3 + ((y || x) ? num_len(y + 1) : 0) + (x ? 1 + num_len(x + 1) : 0);
+    int how = 0;
+
+    if (s_cursor >= 0) {
+        int cy = s_cursor / s_cols - s_wrap;
+        int cx = s_wrap ? s_cols - 1 : s_cursor % s_cols;
+        if (!s_wrap && y == cy && x > cx && cuf_cost(x - cx) < cost) {
+            cost = cuf_cost(x - cx); how = 1;
+        }
+        if (y == cy + 1 && 2 + cuf_cost(x) < cost) {
+            cost = 2 + cuf_cost(x); how = 2;
+        }
+    }
+    if (!emit) return cost;
+
+    if (how == 1) {
+        push_cuf(x - s_cursor % s_cols);
+    } else if (how == 2) {
+        push_str("\r\n");
+        push_cuf(x);
+    } else {
+        push_str("\033[");
+        if (y || x) push_num(y + 1);
+        if (x) { push_char(';'); push_num(x + 1); }
+        push_char('H');
+    }
+    s_cursor = cell;
+    s_wrap = 0;
+    return cost;
+}
+
+/* Write cells [cell, end), the cursor being at cell */
+static void push_run(int cell, int end) {
+    int i = s_back[cell];
+    if (s_color_id[i] != s_cur_color) {
+        push_color(i);
+        s_cur_color = s_color_id[i];
+    }
+    push_char(s_enc_blocks ? ' ' : CHARS[i >> s_level_shift]);
+    if (end - cell > 1) {
+        push_str("\033[");
+        push_num(end - cell - 1);
+        push_char('b');
+    }
+    s_cursor = end;     // Relies on autowrap at the end of a row
+    s_wrap = end % s_cols == 0;
+    if (!s_count_only) memcpy(s_front + cell, s_back + cell, end - cell);
+}
+
+/* Bytes to rewrite cells [from, to) with the current color state */
+static int gap_cost(int from, int to) {
+    int cost = 0, color = s_cur_color;
+    for (int c = from; c < to; c++) {
+        int id = s_color_id[s_back[c]];
+        if (id != color) { cost += s_esc_len[id]; color = id; }
+        cost++;
+    }
+    return cost;
+}
+
+/*
+ * Go to cell, or write through the unchanged gap before it when that is
+ * cheaper, then send the cell. With REP, the run extends over the same
+ * glyph to the last changed cell in the row. Returns the cell after it.
+ * A gap must not change color when the caller is sending one color.
+ */
+enum { EMIT_FULL, EMIT_ROWS, EMIT_COLORS };
+
+static int emit_at(int cell, int mode) {
+    int n = s_rows * s_cols - 1;
+    int full = mode == EMIT_FULL;
+
+    if (s_cursor != cell) {
+        int gap = s_cursor >= 0 && s_cursor < cell && cell - s_cursor <= DIFF_BRIDGE;
+        if (gap) {
+            int cost = gap_cost(s_cursor, cell);
+            gap = cost <= push_goto(cell, 0) && (mode != EMIT_COLORS || cost == cell - s_cursor);
+        }
+        if (gap) {
+            while (s_cursor < cell) push_run(s_cursor, s_cursor + 1);
+        } else {
+            push_goto(cell, 1);
+        }
+    }
+
+    int end = cell + 1;
+    if (s_enc_rep) {
+        int row_end = (cell / s_cols + 1) * s_cols;
+        if (row_end > n) row_end = n;
+        for (int c = cell + 1; c < row_end && s_back[c] == s_back[cell]; c++) {
+            if (full || s_back[c] != s_front[c]) end = c + 1;
+        }
+        if (end - cell - 1 <= 3 + num_len(end - cell - 1)) end = cell + 1;
+    }
+    push_run(cell, end);
+    return end;
+}
+
+/*
+ * Changed cells bucketed by color: sending one color at a time costs
+ * a CUP per cell but each SGR only once, which beats row order when
+ * the bands move and most changed cells switch color.
+ */
+static int *s_order;            // Changed cells, grouped by s_color_id
+static int  s_bucket[MAX_LEVELS + 1];   // Start of each color's cells in s_order
+
+/* A changed cell whose row waits for the next frame */
+static int row_skipped(int cell) { return s_interlace && (cell / s_cols & 1) != s_parity; }
+
+static void sort_changes(void) {
+    int n = s_rows * s_cols - 1;
+    int count[MAX_LEVELS] = { 0 };
+    for (int cell = 0; cell < n; cell++) {
+        if (s_back[cell] != s_front[cell] && !row_skipped(cell)) count[s_color_id[s_back[cell]]]++;
+    }
+    s_bucket[0] = 0;
+    for (int c = 0; c < s_levels; c++) s_bucket[c + 1] = s_bucket[c] + count[c];
+
+    int pos[MAX_LEVELS];
+    memcpy(pos, s_bucket, sizeof(pos));
+    for (int cell = 0; cell < n; cell++) {
+        if (s_back[cell] != s_front[cell] && !row_skipped(cell)) s_order[pos[s_color_id[s_back[cell]]]++] = cell;
+    }
+}
+
+/*
+ * With a budget, a frame stops short once one more step (move, color,
+ * glyph and REP: EMIT_STEP_MAX bytes at most) might not fit. The cells
+ * it skipped still differ from s_front and go out with the next frame.
+ */
+#define EMIT_STEP_MAX 48
+
+static long s_frame_start;
+
+static int over_budget(void) {
+    long budget = s_budget;
+    if (s_gov_budget && (!budget || s_gov_budget < budget)) budget = s_gov_budget;
+    return budget && !s_count_only && s_out_count - s_frame_start > budget - EMIT_STEP_MAX;
+}
+
+static void emit_cells(int mode) {
+    int n = s_rows * s_cols - 1;    // The last cell is never written: it would scroll
+
+    if (mode == EMIT_COLORS) {
+        /* Start with the color the terminal already has */
+        int first = s_cur_color < 0 ? 0 : s_cur_color;
+        for (int k = 0; k < s_levels; k++) {
+            int c = (first + k) % s_levels, end = 0;
+            for (int i = s_bucket[c]; i < s_bucket[c + 1]; i++) {
+                if (over_budget()) return;
+                if (s_order[i] >= end) end = emit_at(s_order[i], mode);
+            }
+        }
+        return;
+    }
+
+    if (mode == EMIT_FULL) push_goto(0, 1);
+    for (int cell = 0; cell < n; ) {
+        if (mode == EMIT_ROWS && (s_back[cell] == s_front[cell] || row_skipped(cell))) { cell++; continue; }
+        if (over_budget()) return;
+        cell = emit_at(cell, mode);
+    }
+}
+
+static long frame_cost(int mode) {
+    int cursor = s_cursor, wrap = s_wrap, color = s_cur_color;
+    long start = s_out_count;
+    s_count_only = 1;
+    emit_cells(mode);
+    s_count_only = 0;
+    s_cursor = cursor; s_wrap = wrap; s_cur_color = color;
+
+    long cost = s_out_count - start;
+    s_out_count = start;
+    return cost;
+}
+
+/* Send s_back in the cheapest of row order, color order or a full repaint;
+ * s_front takes each cell as it is sent */
+static void render_frame(void) {
+    s_parity ^= 1;
+    sort_changes();
+    int mode = EMIT_ROWS;
+    long best = frame_cost(EMIT_ROWS);
+    long cost = frame_cost(EMIT_COLORS);
+    if (cost < best) { best = cost; mode = EMIT_COLORS; }
+    if (best >= s_rows * s_cols && frame_cost(EMIT_FULL) < best) {     // A repaint costs at least a byte per cell
+        mode = EMIT_FULL;
+    }
+    s_frame_start = s_out_count;
+    emit_cells(mode);
+    flush_buf();
+}
 
 static inline float fast_sin(float rads) {
     return s_sin_lut[(int)(rads * RAD_TO_IDX) & SIN_MASK];
 }
 
+#if FIELD_FIXED || defined(PLASMA_BENCH)
+#define SQRT_SIZE  4096     // sqrt table domain: 12 bits of the normalized distance^2
+#define RADIAL_K   (0.08f * RAD_TO_IDX)
+
+static int32_t  s_sin_q[SIN_SIZE];      // sin, Q16
+static uint16_t s_sqrt_k[SQRT_SIZE + 1]; // sqrt(m) * RADIAL_K, Q6
+
+static int32_t round_q(float v) { return (int32_t)(v < 0 ? v - 0.5f : v + 0.5f); }
+#endif
+
 static void init_sin_lut(void) {
     for (int i = 0; i < SIN_SIZE; i++) {
         s_sin_lut[i] = sinf((float)i * (2.0f * 3.14159265f) / (float)SIN_SIZE);
     }
+#if FIELD_FIXED || defined(PLASMA_BENCH)
+    for (int i = 0; i < SIN_SIZE; i++) s_sin_q[i] = round_q(s_sin_lut[i] * 65536.0f);
+    for (int m = 0; m <= SQRT_SIZE; m++) s_sqrt_k[m] = (uint16_t)(sqrtf((float)m) * RADIAL_K * 64.0f + 0.5f);
+#endif
 }
 
-int main(int argc, char **argv) {
-    int rows, cols;
+/*
+ * Field kernel. Each row runs as a few flat passes over the column
+ * caches instead of one loop doing everything per cell, so the compiler
+ * can vectorize all but the sine table lookup. Passes run to a multiple
+ * of 8 columns; the caches are sized and filled that far.
+ */
+#define ROW_PAD(n) (((n) + 7) & ~7)
 
-    plat_init();
-    init_sin_lut();
-    plat_get_size(&rows, &cols);
-    if (cols > CACHE_W) cols = CACHE_W;
+/* Detail the governor can take away: each computed cell stands for a
+ * block of 1 << s_field_shift cells square, and levels keep only the
+ * s_level_keep bits */
+static int s_field_shift = 0;
+static unsigned char s_level_keep = 0xFF;
 
-    push_str("\033[?25l\033[2J"); flush_buf();
+static int field_cols(void) { return (s_cols + (1 << s_field_shift) - 1) >> s_field_shift; }
 
-    srand(time(NULL));
-    float r1 = (float)rand() / RAND_MAX * 10.0f;
-    float r2 = (float)rand() / RAND_MAX * 10.0f;
-    float r3 = (float)rand() / RAND_MAX * 10.0f;
-    float t = 0.0f;
+static float s_seed[3];
+static float s_phase_x, s_phase_y, s_phase_z, s_cx_shift, s_cy_shift;
 
-    while (!has_input_should_exit()) {
-        push_str("\033[H");
-        int last_color = -1;
+static void field_phases(float t) {
+    s_cx_shift = fast_sin(t / 3.0f) * 20.0f;
+    s_cy_shift = cosf(t / 2.0f) * 10.0f;
+    s_phase_x = t + s_seed[0];
+    s_phase_y = t + s_seed[1];
+    s_phase_z = t + s_seed[2];
+}
+
+/* Square root by reciprocal estimate and two Newton steps: no libm call,
+ * no errno, so it vectorizes. Plenty for a LUT index, exact enough that
+ * the palette output matches sqrtf on all but rare boundary cells. */
+static inline float field_sqrt(float v) {
+    union { float f; uint32_t i; } u = { v };
+    u.i = 0x5f3759df - (u.i >> 1);
+    float r = u.f;
+    r = r * (1.5f - 0.5f * v * r * r);
+    r = r * (1.5f - 0.5f * v * r * r);
+    return v * r;
+}
+
+#if !FIELD_FIXED || defined(PLASMA_BENCH)
+static void field_frame_float(float t) {
+    field_phases(t);
+    for (int i = 0; i < ROW_PAD(field_cols()); i++) {
+        int x = i << s_field_shift;
+        s_cache_x_val[i] = fast_sin(x * 0.06f + s_phase_x);
+        float cx = (x - s_cols / 2.0f) + s_cx_shift;
+        s_cache_x_sq[i] = cx * cx;
+    }
+}
+
+static void field_row_float(int y, unsigned char *out, row_scratch_t *rs) {
+    int cols = field_cols(), n = ROW_PAD(cols);
+    float cy = (y - s_rows / 2.0f) * 2.0f + s_cy_shift;
+    float cy_sq = cy * cy;
+    float base = fast_sin(y * 0.12f + s_phase_y) + 10.0f;
+    float phase_z = s_phase_z;
+    const float *x_sq = s_cache_x_sq, *x_val = s_cache_x_val;
+    float *val = rs->val;
+    int *idx = rs->idx;
+
+    /* Radial term's table index */
+    for (int x = 0; x < n; x++) {
+        float arg = field_sqrt(x_sq[x] + cy_sq) * 0.08f + phase_z;
+        idx[x] = (int)(arg * RAD_TO_IDX) & SIN_MASK;
+    }
+    /* The one gather */
+    for (int x = 0; x < n; x++) val[x] = s_sin_lut[idx[x]];
+    /* Level: v in [-3, 3] so the sum is positive and % 32 is & 31;
+     * 16..31 fold back down as 31 - i, which is i ^ 31 (for 16 levels) */
+    int sh = s_level_shift, mask = (32 << sh) - 1;
+    float scale = (float)(4 << sh);
+    for (int x = 0; x < n; x++) {
+        int i = (int)((x_val[x] + val[x] + base) * scale) & mask;
+        idx[x] = i ^ ((i >> (4 + sh)) * mask);
+    }
+    for (int x = 0; x < cols; x++) out[x] = idx[x];
+}
+#endif
+
+#if FIELD_FIXED || defined(PLASMA_BENCH)
+/*
+ * The same field in integers. Sines and phases are Q16 table positions,
+ * so a phase wraps for free in uint32_t; distances are kept in Q4 cells,
+ * which leaves distance^2 room for MAX_COLS x MAX_ROWS. The square root comes
+ * from s_sqrt_k: distance^2 is shifted right by an even count until it
+ * fits the table, the entry (already scaled by RADIAL_K) is interpolated
+ * with the next one on the shifted-out bits, and the result is shifted
+ * back left by half as much. Only per-frame setup touches the FPU.
+ */
+static int32_t  *s_cache_x_val_q;
+static uint32_t *s_cache_x_sq_q;
+static uint32_t s_phase_y_q, s_phase_z_q;
+static int32_t  s_cy0_q;                // Row 0's cy, Q4
+
+static uint32_t phase_q16(float rads) {
+    float i = rads * RAD_TO_IDX;
+    i -= (float)((int32_t)(i / SIN_SIZE) * SIN_SIZE);
+    if (i < 0) i += SIN_SIZE;
+    return (uint32_t)(i * 65536.0f);
+}
+
+static void field_frame_fixed(float t) {
+    field_phases(t);
+
+    uint32_t phase_x = phase_q16(s_phase_x);
+    uint32_t step_x = (uint32_t)(0.06f * RAD_TO_IDX * 65536.0f) << s_field_shift;
+    int32_t cx = round_q((s_cx_shift - s_cols / 2.0f) * 16.0f);
+    for (int x = 0; x < field_cols(); x++, phase_x += step_x, cx += 16 << s_field_shift) {
+        s_cache_x_val_q[x] = s_sin_q[(phase_x >> 16) & SIN_MASK];
+        s_cache_x_sq_q[x] = (uint32_t)(cx * cx);
+    }
+
+    s_phase_y_q = phase_q16(s_phase_y);
+    s_phase_z_q = phase_q16(s_phase_z);
+    s_cy0_q = round_q((s_cy_shift - s_rows / 2.0f * 2.0f) * 16.0f);
+}
+
+static void field_row_fixed(int y, unsigned char *out, row_scratch_t *rs) {
+    static const uint32_t step_y = (uint32_t)(0.12f * RAD_TO_IDX * 65536.0f);
+    int n = field_cols();   // Local: stores through out may alias any global
+    int32_t cy = s_cy0_q + y * 32;
+    uint32_t cy_sq = (uint32_t)(cy * cy);
+    int32_t base = s_sin_q[((s_phase_y_q + y * step_y) >> 16) & SIN_MASK] + (10 << 16);
+    uint32_t phase_z = s_phase_z_q;
+    int ls = s_level_shift, mask = (32 << ls) - 1;
+    (void)rs;
+
+    for (int x = 0; x < n; x++) {
+        uint32_t d = s_cache_x_sq_q[x] + cy_sq;     // Q8
+        int sh = d < SQRT_SIZE ? 0 : (32 - __builtin_clz(d) - 11) & ~1;
+        uint32_t m = d >> sh, frac = d - (m << sh);
+        uint32_t root = ((uint32_t)s_sqrt_k[m] << (sh / 2))
+                      + (((uint32_t)(s_sqrt_k[m + 1] - s_sqrt_k[m]) * frac) >> (sh / 2));
+        uint32_t arg = (root << 6) + phase_z;
 
-        float cx_shift = fast_sin(t / 3.0f) * 20.0f;
-        float phase_x = t + r1;
-        float phase_z = t + r3;
+        /* (v + 10) * 4 in Q16 is the sum >> 14; more levels, less shift */
+        int32_t v = s_cache_x_val_q[x] + s_sin_q[(arg >> 16) & SIN_MASK] + base;
+        int i = (v >> (14 - ls)) & mask;
+        out[x] = i ^ ((i >> (4 + ls)) * mask);
+    }
+}
+#endif
 
-        for (int x = 0; x < cols; x++) {
-            s_cache_x_val[x] = fast_sin(x * 0.06f + phase_x);
-            float cx = (x - cols / 2.0f) + cx_shift;
-            s_cache_x_sq[x] = cx * cx;
+#if FIELD_FIXED
+    #define field_frame field_frame_fixed
+    #define field_row   field_row_fixed
+#else
+    #define field_frame field_frame_float
+    #define field_row   field_row_float
+#endif
+
+/* Rows [y0, y1) of grid at the current detail. A row computed at half
+ * resolution is spread out in place from the right; the rows it stands
+ * for copy it, except at y0, since the row above may be another band's */
+static void field_rows(unsigned char *grid, int y0, int y1, row_scratch_t *rs) {
+    int sh = s_field_shift, cols = field_cols();
+    unsigned char keep = s_level_keep;
+
+    for (int y = y0; y < y1; y++) {
+        unsigned char *out = grid + y * s_cols;
+        int src = y >> sh << sh;
+        if (src != y && y > y0) {
+            memcpy(out, out - s_cols, s_cols);
+            continue;
+        }
+        field_row(src, out, rs);
+        if (keep != 0xFF) {
+            for (int x = 0; x < cols; x++) out[x] &= keep;
+        }
+        if (sh) {
+            for (int x = s_cols - 1; x > 0; x--) out[x] = out[x >> sh];
         }
+    }
+}
+
+/*
+ * Per-column arrays, all 4-byte elements: one block, carved into
+ * 64-byte aligned arrays for vector loads. Sized for the grid width at
+ * startup and on resize, never per frame.
+ */
+#define ALIGN64(n) (((n) + 63) & ~(size_t)63)
+
+static void *s_cache_mem;
+
+static void *carve(char **p, size_t size) {
+    void *r = *p;
+    *p += size;
+    return r;
+}
+
+static int caches_init(int cols) {
+    size_t size = ALIGN64(ROW_PAD(cols) * sizeof(float));
+    int count = 0;
+#if !FIELD_FIXED || defined(PLASMA_BENCH)
+    count += 2 + 2 * (MAX_WORKERS + 1);
+#endif
+#if FIELD_FIXED || defined(PLASMA_BENCH)
+    count += 2;
+#endif
+
+    free(s_cache_mem);
+    s_cache_mem = malloc(count * size + 63);
+    if (!s_cache_mem) return 0;
+    char *p = (char *)(((uintptr_t)s_cache_mem + 63) & ~(uintptr_t)63);
+
+#if !FIELD_FIXED || defined(PLASMA_BENCH)
+    s_cache_x_val = carve(&p, size);
+    s_cache_x_sq = carve(&p, size);
+    for (int k = 0; k <= MAX_WORKERS; k++) {
+        s_scratch[k].val = carve(&p, size);
+        s_scratch[k].idx = carve(&p, size);
+    }
+#endif
+#if FIELD_FIXED || defined(PLASMA_BENCH)
+    s_cache_x_val_q = carve(&p, size);
+    s_cache_x_sq_q = carve(&p, size);
+#endif
+    return 1;
+}
+
+#ifdef PLASMA_BENCH
+/* The original cell-at-a-time loop, kept as the kernel bench's reference */
+static void field_row_scalar(int y, unsigned char *out, row_scratch_t *rs) {
+    float cy = (y - s_rows / 2.0f) * 2.0f + s_cy_shift;
+    float cy_sq = cy * cy;
+    float val_y = fast_sin(y * 0.12f + s_phase_y);
+    (void)rs;
+
+    for (int x = 0; x < s_cols; x++) {
+        float dist_sq = s_cache_x_sq[x] + cy_sq;
+        float v = s_cache_x_val[x] + val_y + fast_sin(sqrtf(dist_sq) * 0.08f + s_phase_z);
+
+        int i = ((int)((v + 10.0f) * 4.0f)) % 32;
+        if (i < 0) i = 0;
+        if (i > 15) i = 31 - i;
+        out[x] = i;
+    }
+}
+
+typedef struct {
+    const char *name;
+    void (*frame)(float t);
+    void (*row)(int y, unsigned char *out, row_scratch_t *rs);
+} kernel_t;
+
 
-        float phase_y = t + r2;
-        float cy_shift = cosf(t / 2.0f) * 10.0f;
+static const kernel_t s_kernels[] = {
+    { "scalar", field_frame_float, field_row_scalar },
+    { "rows",   field_frame_float, field_row_float },
+    { "q16",    field_frame_fixed, field_row_fixed },
+};
+#define NUM_KERNELS (int)(sizeof(s_kernels) / sizeof(s_kernels[0]))
 
-        for (int y = 0; y < rows; y++) {
-            float cy = (y - rows / 2.0f) * 2.0f + cy_shift;
-            float cy_sq = cy * cy;
-            float val_y = fast_sin(y * 0.12f + phase_y);
+static void bench_field(const kernel_t *k, unsigned char *grid, float t) {
+    k->frame(t);
+    for (int y = 0; y < s_rows; y++) k->row(y, grid + y * s_cols, &s_scratch[0]);
+}
+
+static double bench_kernel_fps(const kernel_t *k, unsigned char *grid, int frames) {
+    long long start = plat_time_us();
+    for (int f = 0; f < frames; f++) bench_field(k, grid, f * 0.08f);
+    long long us = plat_time_us() - start;
+    return frames * 1000000.0 / (us ? us : 1);
+}
 
-            for (int x = 0; x < cols; x++) {
-                if (y == rows - 1 && x == cols - 1) break;
+static const int s_bench_sizes[][2] = { { 24, 80 }, { 60, 160 }, { 1080, 1920 }, { 2160, 3840 } };
+#define NUM_BENCH_SIZES (int)(sizeof(s_bench_sizes) / sizeof(s_bench_sizes[0]))
 
-                float dist_sq = s_cache_x_sq[x] + cy_sq;
-                float v = s_cache_x_val[x] + val_y + fast_sin(sqrtf(dist_sq) * 0.08f + phase_z);
+/* Field compute only, no output; cell counts are against the scalar loop */
+static int bench_kernel(void) {
+    s_seed[0] = 1.0f; s_seed[1] = 2.0f; s_seed[2] = 3.0f;
+    for (int k = 0; k < NUM_BENCH_SIZES; k++) {
+        s_rows = s_bench_sizes[k][0]; s_cols = s_bench_sizes[k][1];
+        int cells = s_rows * s_cols;
+        int frames = 20000000 / cells + 1;
+        unsigned char *ref = malloc(cells), *grid = malloc(cells);
+        if (!ref || !grid || !caches_init(s_cols)) return 1;
+
+        double base = 0;
+        for (int n = 0; n < NUM_KERNELS; n++) {
+            const kernel_t *kn = &s_kernels[n];
+            double fps = bench_kernel_fps(kn, n ? grid : ref, frames);
+            long diff = 0;
+            if (n) {
+                for (int i = 0; i < cells; i++) diff += ref[i] != grid[i];
+            } else {
+                base = fps;
+            }
+            printf("kernel %4dx%-4d  %-6s %9.1f fps  x%.2f  %ld/%d cells differ\n",
+                   s_cols, s_rows, kn->name, fps, fps / base, diff, cells);
+        }
+        free(ref);
+        free(grid);
+    }
+    return 0;
+}
 
-                int i = ((int)((v + 10.0f) * 4.0f)) % 32;
-                if (i < 0) i = 0;
-                if (i > 15) i = 31 - i;
+/*
+ * Host check of the Q16 kernel against the float one: palette indices
+ * over a few hundred frames at each bench size. A differing cell may be
+ * at most one palette step off, and at most 1% of cells may differ.
+ */
+static int bench_check(void) {
+    int failed = 0;
+    s_seed[0] = 4.2f; s_seed[1] = 7.1f; s_seed[2] = 0.3f;
+    for (int k = 0; k < NUM_BENCH_SIZES; k++) {
+        s_rows = s_bench_sizes[k][0]; s_cols = s_bench_sizes[k][1];
+        int cells = s_rows * s_cols, frames = cells > 1000000 ? 20 : 300;
+        unsigned char *a = malloc(cells), *b = malloc(cells);
+        if (!a || !b || !caches_init(s_cols)) return 1;
 
-                if (i != last_color) {
-                    push_color(i);
-                    last_color = i;
-                }
-                push_char(CHARS[i]);
+        long diff = 0, far = 0;
+        for (int f = 0; f < frames; f++) {
+            bench_field(&s_kernels[1], a, f * 0.08f);
+            bench_field(&s_kernels[2], b, f * 0.08f);
+            for (int i = 0; i < cells; i++) {
+                int d = abs(a[i] - b[i]);
+                diff += d != 0;
+                far += d > 1;
             }
         }
+        double pct = diff * 100.0 / ((double)cells * frames);
+        int ok = far == 0 && pct <= 1.0;
+        printf("check  %4dx%-4d  %d frames  %.3f%% cells differ, %ld by more than one step  %s\n",
+               s_cols, s_rows, frames, pct, far, ok ? "ok" : "FAIL");
+        failed |= !ok;
+        free(a);
+        free(b);
+    }
+    return failed;
+}
+#endif
+
+static void layout_free(void) {
+    free(s_front); free(s_back); free(s_next); free(s_order);
+    free(s_cache_mem);
+    s_front = s_back = s_next = NULL;
+    s_order = NULL;
+    s_cache_mem = NULL;
+}
+
+/* Grids and caches for a rows x cols screen; only between frames */
+static int layout_init(int rows, int cols) {
+    if (rows > MAX_ROWS) rows = MAX_ROWS;
+    if (cols > MAX_COLS) cols = MAX_COLS;
+    layout_free();
+
+    s_rows = rows; s_cols = cols;
+    s_front = malloc(rows * cols);
+    s_back = malloc(rows * cols);
+    s_next = malloc(rows * cols);
+    s_order = malloc(rows * cols * sizeof(int));
+    if (!s_front || !s_back || !s_next || !s_order || !caches_init(cols)) return 0;
+    memset(s_front, 0xFF, rows * cols);     // Nothing on screen matches yet
+    s_cursor = -1;
+    s_cur_color = -1;
+    return 1;
+}
+
+/*
+ * Band workers. A frame's rows are split into one band per worker, and
+ * while they compute frame N+1 into s_next the main thread emits frame
+ * N. With no workers the rows are computed inline before the emit.
+ */
+static int s_workers = 0;
+static unsigned char *volatile s_band_grid;
+
+#if PLASMA_THREADS
+static void compute_band(int k) {
+    int y0 = s_rows * k / s_workers, y1 = s_rows * (k + 1) / s_workers;
+    field_rows(s_band_grid, y0, y1, &s_scratch[k + 1]);
+}
+#endif
+
+#if PLASMA_THREADS && defined(__XTENSA__)
+    static TaskHandle_t s_band_task, s_main_task;
+    static volatile int s_band_quit;
+
+    static void band_worker(void *arg) {
+        (void)arg;
+        for (;;) {
+            ulTaskGenericNotifyTake(0, 1, portMAX_DELAY);
+            if (s_band_quit) break;
+            compute_band(0);
+            xTaskGenericNotify(s_main_task, 0, 0, eIncrement, NULL);
+        }
+        xTaskGenericNotify(s_main_task, 0, 0, eIncrement, NULL);
+        vTaskDelete(NULL);
+    }
+
+    static int bands_start(int n) {
+        (void)n;
+        s_main_task = xTaskGetCurrentTaskHandle();
+        return xTaskCreatePinnedToCore(band_worker, "plasma", 4096, NULL,
+                                       uxTaskPriorityGet(NULL), &s_band_task, 1) == 1;
+    }
+
+    static void bands_kick(void) { xTaskGenericNotify(s_band_task, 0, 0, eIncrement, NULL); }
+    static void bands_wait(void) { ulTaskGenericNotifyTake(0, 1, portMAX_DELAY); }
+
+    static void bands_stop(void) {
+        s_band_quit = 1;
+        bands_kick();
+        bands_wait();
+    }
+
+#elif PLASMA_THREADS
+    static pthread_t s_band_tid[MAX_WORKERS];
+    static pthread_mutex_t s_band_lock = PTHREAD_MUTEX_INITIALIZER;
+    static pthread_cond_t s_band_go = PTHREAD_COND_INITIALIZER;
+    static pthread_cond_t s_band_done = PTHREAD_COND_INITIALIZER;
+    static int s_band_gen, s_band_left, s_band_quit;
+
+    static void *band_worker(void *arg) {
+        int k = (int)(intptr_t)arg, seen = 0;
+        pthread_mutex_lock(&s_band_lock);
+        for (;;) {
+            while (s_band_gen == seen && !s_band_quit) pthread_cond_wait(&s_band_go, &s_band_lock);
+            if (s_band_quit) break;
+            seen = s_band_gen;
+            pthread_mutex_unlock(&s_band_lock);
+
+            compute_band(k);
+
+            pthread_mutex_lock(&s_band_lock);
+            if (--s_band_left == 0) pthread_cond_signal(&s_band_done);
+        }
+        pthread_mutex_unlock(&s_band_lock);
+        return NULL;
+    }
+
+    /* Returns how many workers actually started */
+    static int bands_start(int n) {
+        int k = 0;
+        while (k < n && pthread_create(&s_band_tid[k], NULL, band_worker, (void *)(intptr_t)k) == 0) k++;
+        return k;
+    }
+
+    static void bands_kick(void) {
+        pthread_mutex_lock(&s_band_lock);
+        s_band_left = s_workers;
+        s_band_gen++;
+        pthread_cond_broadcast(&s_band_go);
+        pthread_mutex_unlock(&s_band_lock);
+    }
+
+    static void bands_wait(void) {
+        pthread_mutex_lock(&s_band_lock);
+        while (s_band_left > 0) pthread_cond_wait(&s_band_done, &s_band_lock);
+        pthread_mutex_unlock(&s_band_lock);
+    }
+
+    static void bands_stop(void) {
+        pthread_mutex_lock(&s_band_lock);
+        s_band_quit = 1;
+        pthread_cond_broadcast(&s_band_go);
+        pthread_mutex_unlock(&s_band_lock);
+        for (int k = 0; k < s_workers; k++) pthread_join(s_band_tid[k], NULL);
+    }
+
+#else
+    static int bands_start(int n) { (void)n; return 0; }
+    static void bands_kick(void) {}
+    static void bands_wait(void) {}
+    static void bands_stop(void) {}
+#endif
+
+/* Compute frame t into grid: handed to the workers if there are any
+ * (compute_wait() collects it), otherwise done here and now */
+static void compute_start(float t, unsigned char *grid) {
+    field_frame(t);
+    if (s_workers) {
+        s_band_grid = grid;
+        bands_kick();
+        return;
+    }
+    field_rows(grid, 0, s_rows, &s_scratch[0]);
+}
+
+static void compute_wait(void) {
+    if (s_workers) bands_wait();
+}
+
+/* Emit s_back while the workers compute the frame after it at t. The
+ * compute time is what the emit did not hide: all of it without workers */
+static int s_compute_us, s_emit_us;
+
+static void pipeline_frame(float t) {
+    long long t0 = plat_time_us();
+    compute_start(t, s_next);
+    long long t1 = plat_time_us();
+    render_frame();
+    long long t2 = plat_time_us();
+    compute_wait();
+    long long t3 = plat_time_us();
+    s_compute_us = (int)(t1 - t0 + t3 - t2);
+    s_emit_us = (int)(t2 - t1);
+
+    unsigned char *tmp = s_back;
+    s_back = s_next; s_next = tmp;
+}
+
+/*
+ * Quality governor. Each frame's compute and emit time (the emit waits
+ * on the terminal: a write blocks once the tty or vterm falls behind)
+ * is averaged; when the average nears the frame period, detail steps
+ * down the ladder below, and when it has stayed under half the period
+ * for a while, back up. A step up that has to be taken back within two
+ * seconds doubles the wait before the next try, so a level that does
+ * not fit is not retried every second.
+ */
+typedef struct {
+    unsigned char shift;    // s_field_shift
+    unsigned char levels;   // At most this many levels
+    unsigned char skip;     // Rows interlaced, diffs cut to what the terminal takes in a frame
+} quality_t;
+
+static const quality_t s_quality_ladder[] = {
+    { 0, 128, 0 },
+    { 0, 16, 0 },
+    { 1, 16, 0 },      // Half resolution
+    { 1, 8, 0 },
+    { 1, 4, 0 },
+    { 1, 4, 1 },
+};
+#define LADDER_LEN  (int)(sizeof(s_quality_ladder) / sizeof(s_quality_ladder[0]))
+#define FRAME_US    (1000000 / TARGET_FPS)
 
-        flush_buf();
+/* The ladder at the active level count, less the steps that change
+ * nothing there (128 levels down to 16 when there are only 16), so
+ * every quality a user can pick looks different */
+static quality_t s_quality_steps[LADDER_LEN];
+static unsigned char s_quality_keep[LADDER_LEN];    // s_level_keep for each
+static int s_quality_count;
+
+static int s_governor = 1;
+static int s_quality = 0;       // Index into s_quality_steps
+static float s_load_us, s_avg_compute_us, s_avg_emit_us, s_avg_bytes;
+static int s_gov_hold;          // Frames before the next decision
+static int s_gov_calm;          // Frames in a row with headroom
+static int s_gov_wait = TARGET_FPS;     // Calm frames needed to step up
+static int s_gov_up_age;        // Frames since the last step up
+
+/* After init_colors(), which sets s_levels */
+static void quality_init(void) {
+    s_quality_count = 0;
+    for (int i = 0; i < LADDER_LEN; i++) {
+        const quality_t *q = &s_quality_ladder[i];
+        int drop = 0, n = s_quality_count;
+        while ((s_levels >> drop) > q->levels) drop++;
+        unsigned char keep = (unsigned char)(0xFF << drop);
+        if (n && s_quality_steps[n - 1].shift == q->shift && s_quality_steps[n - 1].skip == q->skip
+              && s_quality_keep[n - 1] == keep) {
+            continue;
+        }
+        s_quality_steps[n] = *q;
+        s_quality_keep[n] = keep;
+        s_quality_count++;
+    }
+}
+
+/* Between frames only: the workers read these */
+static void quality_set(int q) {
+    s_quality = q;
+    s_field_shift = s_quality_steps[q].shift;
+    s_level_keep = s_quality_keep[q];
+    s_interlace = s_quality_steps[q].skip;
+    if (!s_interlace) s_gov_budget = 0;
+}
+
+static void governor_reset(void) {
+    s_gov_hold = TARGET_FPS / 5;    // Let a repaint pass
+    s_gov_calm = 0;
+}
+
+static void governor_frame(void) {
+    int bytes = (int)(s_out_count - s_frame_start);
+    s_load_us += (s_compute_us + s_emit_us - s_load_us) * 0.125f;
+    s_avg_compute_us += (s_compute_us - s_avg_compute_us) * 0.125f;
+    s_avg_emit_us += (s_emit_us - s_avg_emit_us) * 0.125f;
+    s_avg_bytes += (bytes - s_avg_bytes) * 0.125f;
+    s_gov_up_age++;
+
+    if (s_quality_steps[s_quality].skip) {
+        /* What the emit moved per us, over the time compute leaves */
+        float room = FRAME_US * 0.9f - s_avg_compute_us;
+        long budget = (long)(room * s_avg_bytes / (s_avg_emit_us > 1.0f ? s_avg_emit_us : 1.0f));
+        s_gov_budget = budget > 4 * EMIT_STEP_MAX ? budget : 4 * EMIT_STEP_MAX;
+    }
+    if (!s_governor) return;
+    if (s_gov_hold > 0) { s_gov_hold--; return; }
+
+    int q = s_quality;
+    if (s_load_us > FRAME_US * 0.9f && q < s_quality_count - 1) {
+        q++;
+        if (s_gov_up_age < 2 * TARGET_FPS && s_gov_wait < 32 * TARGET_FPS) s_gov_wait *= 2;
+    } else if (s_load_us < FRAME_US * 0.5f && q > 0) {
+        if (++s_gov_calm < s_gov_wait) return;
+        q--;
+        s_gov_up_age = 0;
+    } else {
+        s_gov_calm = 0;
+        return;
+    }
+    quality_set(q);
+    s_gov_hold = TARGET_FPS / 5;
+    s_gov_calm = 0;
+}
+
+/*
+ * Status line under the field: quality and the frame rate achieved
+ * over the last second. Redrawn once a second, on a quality change and
+ * after a resize; the field owns every other row.
+ */
+static int s_overlay = 0;
+static int s_overlay_on;        // ...and the screen has room for it
+static int s_overlay_frames, s_overlay_quality = -1;
+static long long s_overlay_us;
+static float s_overlay_fps;
+
+static int layout_screen(int rows, int cols) {
+    s_overlay_on = s_overlay && rows > 1;
+    s_overlay_quality = -1;
+    return layout_init(rows - s_overlay_on, cols);
+}
+
+static void overlay_frame(void) {
+    long long now = plat_time_us();
+    s_overlay_frames++;
+    if (now - s_overlay_us >= 1000000) {
+        s_overlay_fps = s_overlay_frames * 1000000.0f / (now - s_overlay_us);
+        s_overlay_frames = 0;
+        s_overlay_us = now;
+    } else if (s_quality == s_overlay_quality || s_overlay_fps == 0) {
+        return;
+    }
+    s_overlay_quality = s_quality;
+
+    char line[80];
+    int n = snprintf(line, sizeof(line), " quality %d/%d  %.1f fps  compute %.1f ms  write %.1f ms",
+                     s_quality_count - 1 - s_quality, s_quality_count - 1, s_overlay_fps,
+                     s_avg_compute_us / 1000, s_avg_emit_us / 1000);
+    if (n > (int)sizeof(line) - 1) n = sizeof(line) - 1;
+    if (n > s_cols - 1) n = s_cols - 1;     // The last column would wrap
+    push_str("\033[0m\033[");
+    push_num(s_rows + 1);
+    push_char('H');
+    push_bytes(line, n);
+    push_str("\033[K");
+    flush_buf();
+    s_cursor = -1;
+    s_cur_color = -1;
+}
+
+/*
+ * Headless run: n frames into the memory sink, unpaced and with fixed
+ * seeds. The field is timed alone first, then the pipeline: emit time,
+ * and frame time including any wait for the workers.
+ */
+static int cmp_int(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+static void bench_stat(const char *name, int *us, int n) {
+    long long sum = 0;
+    for (int i = 0; i < n; i++) sum += us[i];
+    qsort(us, n, sizeof(int), cmp_int);
+    printf("%-8s mean %7.1f  p50 %6d  p90 %6d  p99 %6d  max %6d us\n", name,
+           (double)sum / n, us[n / 2], us[n * 9 / 10], us[n * 99 / 100], us[n - 1]);
+}
+
+static int run_bench(int n, int rows, int cols) {
+    int *compute = malloc(n * sizeof(int));
+    int *emit = malloc(n * sizeof(int));
+    int *total = malloc(n * sizeof(int));
+    int *bytes = malloc(n * sizeof(int));
+    if (!compute || !emit || !total || !bytes || !layout_init(rows, cols)) {
+        fprintf(stderr, "plasma: out of memory\n");
+        return 1;
+    }
+
+    s_out_fd = -1;
+    s_seed[0] = 1.0f; s_seed[1] = 2.0f; s_seed[2] = 3.0f;
+
+    /* The field alone, across the workers */
+    for (int f = 0; f < n; f++) {
+        long long t0 = plat_time_us();
+        compute_start(f * 0.08f, s_back);
+        compute_wait();
+        compute[f] = (int)(plat_time_us() - t0);
+    }
+
+    /* The whole pipeline, computing each frame while emitting the last */
+    compute_start(0.0f, s_back);
+    compute_wait();
+    long stale = 0;     // Cells left behind by the budget, summed over frames
+    long long start = plat_time_us();
+    for (int f = 0; f < n; f++) {
+        long long t0 = plat_time_us();
+        long before = s_out_count;
+        compute_start((f + 1) * 0.08f, s_next);
+        render_frame();
+        long long t1 = plat_time_us();
+        compute_wait();
+        long long t2 = plat_time_us();
+
+        if (s_budget) {
+            for (int c = 0; c < rows * cols - 1; c++) stale += s_front[c] != s_back[c];
+        }
+        unsigned char *tmp = s_back;
+        s_back = s_next; s_next = tmp;
+        emit[f] = (int)(t1 - t0);
+        total[f] = (int)(t2 - t0);
+        bytes[f] = (int)(s_out_count - before);
+    }
+    long long elapsed = plat_time_us() - start;
+
+    static const char *modes[] = { "16-color", "256-color", "truecolor" };
+    printf("%d frames at %dx%d, %.1f fps unpaced, %d worker%s, %s, %d levels, quality %d%s%s%s\n",
+           n, cols, rows, n * 1000000.0 / (elapsed ? elapsed : 1), s_workers, s_workers == 1 ? "" : "s",
+           modes[s_color_mode], s_levels, s_quality_count - 1 - s_quality, FIELD_FIXED ? ", Q16 kernel" : "",
+           s_enc_rep ? ", REP" : "", s_enc_blocks ? ", blocks" : "");
+    bench_stat("compute", compute, n);
+    bench_stat("emit", emit, n);
+    bench_stat("frame", total, n);
+    int first = bytes[0];
+    long long sum = 0;
+    for (int i = 0; i < n; i++) sum += bytes[i];
+    qsort(bytes, n, sizeof(int), cmp_int);
+    printf("bytes    mean %7lld  p50 %6d  p90 %6d  p99 %6d  max %6d  first frame %d\n",
+           sum / n, bytes[n / 2], bytes[n * 9 / 10], bytes[n * 99 / 100], bytes[n - 1], first);
+    if (s_budget) {
+        printf("budget   %ld bytes/frame, %.1f%% of cells behind after a frame\n",
+               s_budget, stale * 100.0 / ((double)n * (rows * cols - 1)));
+    }
+
+    free(compute); free(emit); free(total); free(bytes);
+    layout_free();
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int rows, cols;
+
+#ifdef PLASMA_BENCH
+    if (argc >= 2 && strcmp(argv[1], "--bench-kernel") == 0) {
+        init_sin_lut();
+        return bench_kernel();
+    }
+    if (argc >= 2 && strcmp(argv[1], "--check") == 0) {
+        init_sin_lut();
+        return bench_check();
+    }
+#endif
+
+    /* plasma [--rep] [--blocks] [--colors 16|256|true] [--levels N] [--budget BYTES]
+     *        [--quality N] [--overlay] [--threads N] [--bench N [COLSxROWS]] */
+    int bench = 0, threads = 0, quality = -1, bad = 0;
+    rows = 24; cols = 80;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--rep") == 0) {
+            s_enc_rep = 1;
+        } else if (strcmp(argv[i], "--blocks") == 0) {
+            s_enc_blocks = 1;
+        } else if (strcmp(argv[i], "--colors") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "16") == 0) s_color_mode = COLORS_16;
+            else if (strcmp(argv[i], "256") == 0) s_color_mode = COLORS_256;
+            else if (strcmp(argv[i], "true") == 0) s_color_mode = COLORS_TRUE;
+            else bad = 1;
+        } else if (strcmp(argv[i], "--levels") == 0 && i + 1 < argc) {
+            int levels = atoi(argv[++i]);
+            for (s_level_shift = 0; (16 << s_level_shift) < levels && s_level_shift < 3; s_level_shift++) {}
+            if ((16 << s_level_shift) != levels) bad = 1;
+        } else if (strcmp(argv[i], "--budget") == 0 && i + 1 < argc) {
+            s_budget = atol(argv[++i]);
+            if (s_budget < EMIT_STEP_MAX) bad = 1;
+        } else if (strcmp(argv[i], "--quality") == 0 && i + 1 < argc) {
+            quality = atoi(argv[++i]);
+            if (quality < 0) bad = 1;
+        } else if (strcmp(argv[i], "--overlay") == 0) {
+            s_overlay = 1;
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+            if (threads < 0 || threads > MAX_WORKERS) bad = 1;
+        } else if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc) {
+            bench = atoi(argv[++i]);
+            if (bench < 1) bad = 1;
+        } else if (bench && sscanf(argv[i], "%dx%d", &cols, &rows) == 2) {
+            continue;
+        } else {
+            bad = 1;
+        }
+    }
+    init_colors();
+    quality_init();     // How many qualities depends on the levels
+    if (bad || quality >= s_quality_count || rows < 1 || cols < 1) {
+        fprintf(stderr, "usage: plasma [--rep] [--blocks] [--colors 16|256|true] [--levels 16|32|64|128]\n"
+                        "              [--budget BYTES] [--quality 0-%d] [--overlay] [--threads N]\n"
+                        "              [--bench N [COLSxROWS]]\n", s_quality_count - 1);
+        return 1;
+    }
+    /* A fixed quality turns the governor off; the bench always runs fixed */
+    if (quality >= 0 || bench) s_governor = 0;
+    if (quality >= 0) quality_set(s_quality_count - 1 - quality);
+
+    /* Headless, default 80x24 */
+    if (bench) {
+        init_sin_lut();
+        s_workers = bands_start(threads);
+        int rc = run_bench(bench, rows, cols);
+        bands_stop();
+        return rc;
+    }
+
+    plat_init();
+    init_sin_lut();
+    plat_get_size(&rows, &cols);
+
+    if (!layout_screen(rows, cols)) {
+        plat_cleanup();
+        return 1;
+    }
+
+    s_workers = bands_start(threads);
+    push_str("\033[?25l\033[2J"); flush_buf();
+
+    srand(time(NULL));
+    for (int i = 0; i < 3; i++) s_seed[i] = (float)rand() / RAND_MAX * 10.0f;
+    float t = 0.0f;
+    compute_start(t, s_back);
+    compute_wait();
+
+    long frames = 0;
+    long long start_us = plat_time_us();
+    long start_bytes = s_out_count;
+    s_overlay_us = start_us;
+    governor_reset();
+
+    while (!has_input_should_exit()) {
+        if (plat_take_resize()) {
+            plat_get_size(&rows, &cols);
+            if (!layout_screen(rows, cols)) break;
+            push_str("\033[2J");
+            compute_start(t, s_back);
+            compute_wait();
+            governor_reset();
+        }
         t += 0.08f;
+        pipeline_frame(t);
+        governor_frame();
+        if (s_overlay_on) overlay_frame();
+        frames++;
         plat_sync_frame();
     }
+    bands_stop();
+
+    long long elapsed_us = plat_time_us() - start_us;
+    long bytes = s_out_count - start_bytes;
 
     plat_cleanup();
 
     /* Reset colors and clear */
     push_str("\033[0m\033[2J\033[H"); flush_buf();
 
+    if (frames > 0 && elapsed_us > 0) {
+        printf("%ld frames, %ld bytes/frame, %.1f fps\n",
+               frames, bytes / frames, frames * 1000000.0 / elapsed_us);
+    }
+    layout_free();
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,6 @@
+#!/bin/sh
+
+# Host build with the micro-benchmarks compiled in; run as ./vi-bench --bench
+# The last rows replay canned sessions (open, page, type, paste, save)
+# through "vi -s" and print per-session frames, bytes and times
+gcc -O2 -DVI_BENCH vi.c -o vi-bench
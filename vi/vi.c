@@ -3,9 +3,24 @@
  *
  * Inspired by byllgrim/mvi
  *
- * Supports: arrow keys, i (insert), ESC (normal), :w, :q, :q!, :wq
+ * Supports: arrow keys, i (insert), ESC (normal), u/Ctrl-R (undo/redo),
+ *           Ctrl-F/Ctrl-B (page),
+ *           counts, d/c/y with h j k l w b e 0 ^ $ G gg, x X D C Y p P,
+ *           registers "a-"z,
+ *           /, ?, n, N (search), :w, :q, :q!, :wq, :e, :bn, :bp,
+ *           :[range]s/a/b/g, :g/a/d, :v/a/d, :[range]d, :N, :r file,
+ *           C/shell/Makefile syntax colours, .name.swp crash recovery,
+ *           UTF-8 text
+ *
+ * Usage: vi [-L] [-s script] [file...]
+ *        -L prints key-to-paint latency on exit
+ *        -s replays keys from script ("-" for stdin) headless, per-frame stats
  */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE             /* copy_file_range */
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -15,9 +30,20 @@
 
 /* ========== Configuration ========== */
 #define MAX_LINES       4096
-#define MAX_LINE_LEN    1024
-#define CMD_BUF_SIZE    64
-#define ESC_BUF_SIZE    8
+#define CMD_BUF_SIZE    128     /* Room for :s/pattern/replacement/ */
+#define IN_BUF_SIZE     4096    /* Pending input drained per read */
+#define PASTE_RUN       256     /* Printable bytes inserted per line_insert */
+#define SRC_PAGE        4096    /* File read granularity for the paged source */
+#define SRC_SLOTS       4       /* Paged source windows kept in RAM */
+#define SAVE_BUF_SIZE   32768   /* Batch for edited lines on save */
+#define UNDO_BUDGET     65536   /* Undo journal arena, allocated once */
+#define INCSEARCH_LINES 4096    /* Lines scanned per keystroke while typing a search */
+#define POOL_SLAB       4096    /* Heap block that short line buffers are carved from */
+#define ESC_WAIT_MS     25      /* Wait for the rest of a split escape sequence */
+#define SWAP_CHUNK      4096    /* Swap file write size, one flash page */
+#define SWAP_IDLE_MS    1000    /* Input idle time before pending swap records go out */
+#define HEADLESS_ROWS   24      /* Virtual screen for -s replays */
+#define HEADLESS_COLS   80
 
 /* ========== ANSI Escape Codes ========== */
 #define ESC_CLEAR       "\033[2J"
@@ -27,13 +53,20 @@
 #define ESC_RESET       "\033[0m"
 #define ESC_REVERSE     "\033[7m"
 #define ESC_BOLD        "\033[1m"
+#define ESC_EL          "\033[K"
 
 /* ========== Platform Abstraction ========== */
 #ifdef __XTENSA__
     /* ESP32-S3 */
+    #include <stdint.h>
+    #include <sys/select.h>
     void vterm_get_size(int *rows, int *cols);
 
+    #define PLAT_WAIT_MS    250     /* Idle wakeups to notice a console resize */
+    int64_t esp_timer_get_time(void);
+
     static int s_orig_fcntl;
+    static int s_rows, s_cols;      /* Size last handed to the editor */
 
     static void plat_init(void) {
         s_orig_fcntl = fcntl(STDIN_FILENO, F_GETFL, 0);
@@ -46,19 +79,66 @@
 
     static void plat_get_size(int *rows, int *cols) {
         vterm_get_size(rows, cols);
+        s_rows = *rows;
+        s_cols = *cols;
     }
 
-    static void plat_delay_ms(int ms) {
+    /*
+     * Block until stdin is readable or timeout_ms passes (-1: forever).
+     * The console VFS implements select() on a FreeRTOS semaphore given
+     * by the input driver, so the task sleeps instead of polling. Consoles
+     * without select support fall back to a one-tick delay.
+     */
+    static int plat_wait_input(int timeout_ms) {
+        fd_set rfds;
+        struct timeval tv;
+        FD_ZERO(&rfds);
+        FD_SET(STDIN_FILENO, &rfds);
+        tv.tv_sec = timeout_ms / 1000;
+        tv.tv_usec = (timeout_ms % 1000) * 1000;
+        int n = select(STDIN_FILENO + 1, &rfds, NULL, NULL, timeout_ms < 0 ? NULL : &tv);
+        if (n >= 0) return n > 0;
+
         extern void vTaskDelay(unsigned int);
-        vTaskDelay(ms / 10);  /* portTICK_PERIOD_MS = 10 */
+        vTaskDelay(1);  /* portTICK_PERIOD_MS = 10 */
+        return 1;       /* Unknown; let the caller try a read */
+    }
+
+    /* The console has no resize signal; compare sizes each time we wake */
+    static int plat_take_resize(void) {
+        int rows, cols;
+        vterm_get_size(&rows, &cols);
+        return rows != s_rows || cols != s_cols;
+    }
+
+    static long long plat_time_us(void) {
+        return esp_timer_get_time();
     }
 
 #else
     /* POSIX / Mac */
     #include <sys/ioctl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
     #include <termios.h>
+    #include <time.h>
+    #include <poll.h>
+    #include <signal.h>
+    #include <errno.h>
+
+    #define PLAT_WAIT_MS    -1      /* SIGWINCH wakes poll(); no timeout needed */
 
     static struct termios s_orig_termios;
+    static int s_winch_pipe[2] = { -1, -1 };   /* Self-pipe that wakes poll() on resize */
+    static volatile sig_atomic_t s_resized;
+
+    static void on_winch(int sig) {
+        int saved = errno;
+        (void)sig;
+        s_resized = 1;
+        if (write(s_winch_pipe[1], "", 1) < 0) {}
+        errno = saved;
+    }
 
     static void plat_init(void) {
         tcgetattr(STDIN_FILENO, &s_orig_termios);
@@ -66,17 +146,32 @@
         raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
         raw.c_iflag &= ~(IXON | ICRNL | BRKINT | INPCK | ISTRIP);
         raw.c_cc[VMIN] = 0;
-        raw.c_cc[VTIME] = 1;  /* 100ms timeout */
+        raw.c_cc[VTIME] = 0;  /* Reads never block; poll() does the waiting */
         tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+
+        if (pipe(s_winch_pipe) == 0) {
+            fcntl(s_winch_pipe[0], F_SETFL, O_NONBLOCK);
+            fcntl(s_winch_pipe[1], F_SETFL, O_NONBLOCK);
+            struct sigaction sa;
+            memset(&sa, 0, sizeof(sa));
+            sa.sa_handler = on_winch;
+            sigemptyset(&sa.sa_mask);
+            sigaction(SIGWINCH, &sa, NULL);
+        }
     }
 
     static void plat_cleanup(void) {
         tcsetattr(STDIN_FILENO, TCSANOW, &s_orig_termios);
+        if (s_winch_pipe[0] >= 0) {
+            signal(SIGWINCH, SIG_DFL);
+            close(s_winch_pipe[0]);
+            close(s_winch_pipe[1]);
+        }
     }
 
     static void plat_get_size(int *rows, int *cols) {
         struct winsize w;
-        if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) == 0) {
+        if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) == 0 && w.ws_row > 0 && w.ws_col > 0) {
             *rows = w.ws_row;
             *cols = w.ws_col;
         } else {
@@ -85,15 +180,50 @@
         }
     }
 
-    static void plat_delay_ms(int ms) {
-        usleep(ms * 1000);
+    /*
+     * Block until stdin is readable, a SIGWINCH arrives, or timeout_ms
+     * passes (-1: forever). Returns 1 if input is ready, -1 on hangup.
+     */
+    static int plat_wait_input(int timeout_ms) {
+        struct pollfd fds[2] = {
+            { STDIN_FILENO, POLLIN, 0 },
+            { s_winch_pipe[0], POLLIN, 0 },
+        };
+        int n;
+        do {
+            n = poll(fds, 2, timeout_ms);
+        } while (n < 0 && errno == EINTR);
+        if (n <= 0) return 0;
+
+        if (fds[1].revents & POLLIN) {
+            char drain[16];
+            while (read(s_winch_pipe[0], drain, sizeof(drain)) > 0) {}
+        }
+        /* A hung-up tty also reports POLLIN, but reads nothing more */
+        if (fds[0].revents & (POLLHUP | POLLERR)) return -1;
+        return (fds[0].revents & POLLIN) ? 1 : 0;
+    }
+
+    static int plat_take_resize(void) {
+        int r = s_resized;
+        s_resized = 0;
+        return r;
+    }
+
+    static long long plat_time_us(void) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
     }
 #endif
 
 /* ========== Editor Modes ========== */
-enum { MODE_NORMAL, MODE_INSERT, MODE_COMMAND };
+enum { MODE_NORMAL, MODE_INSERT, MODE_COMMAND, MODE_SEARCH, MODE_RECOVER };
 
 /* ========== Special Keys ========== */
+#define CTRL_KEY(k)     ((k) & 0x1F)
+#define TEXT_KEY(k)     ((k) >= 32 && (k) < 256 && (k) != 127)     /* ASCII or a UTF-8 byte */
+
 enum {
     KEY_NONE = 0,
     KEY_UP = 1000,
@@ -105,12 +235,49 @@ enum {
     KEY_DELETE,
     KEY_BACKSPACE,
     KEY_ENTER,
-    KEY_ESC
+    KEY_ESC,
+    KEY_PAGE_UP,
+    KEY_PAGE_DOWN
 };
 
+/* ========== Line Storage ========== */
+/*
+ * Each line is a gap buffer: text occupies [0, gap) and [gap + cap - len, cap).
+ * Typing moves the gap to the cursor once, after which every keystroke is a
+ * single byte store. Capacity doubles on growth, so inserts are amortized
+ * O(1) and do not hit the heap per keystroke.
+ *
+ * Lines loaded from a file start out unmaterialized (cap == 0): their text
+ * is read from the file source at off until the first edit copies it out.
+ */
+typedef struct {
+    char *buf;              /* Text with a gap, not NUL-terminated */
+    int len;                /* Cached text length (excluding gap) */
+    int cap;                /* Allocated bytes, 0 while backed by the source */
+    int gap;                /* Gap start */
+    unsigned char hl;       /* Lexer state at end of line, see Syntax Highlighting */
+    unsigned char utf;      /* UTF_*, see UTF-8 Columns */
+    long off;               /* Source offset of unchanged text, or -1 */
+} line_t;
+
+#define LINE_MIN_CAP    16
+
+/* line_t.utf: whether the text is plain ASCII, found out on demand */
+enum { UTF_UNKNOWN, UTF_ASCII, UTF_MULTI };
+#define UTF_CONT(c)     (((unsigned char)(c) & 0xC0) == 0x80)
+#define UTF_MAX         4       /* Bytes in one character */
+
+/* line_t.hl: lexer state in the low bits, HL_DIRTY once the text changed */
+enum { HL_NORMAL, HL_COMMENT, HL_SQUOTE, HL_DQUOTE };
+#define HL_STATE        0x7F
+#define HL_DIRTY        0x80
+#define HL_UNKNOWN      (HL_STATE | HL_DIRTY)   /* Never lexed */
+
+enum { SYN_NONE, SYN_C, SYN_SH, SYN_MAKE };
+
 /* ========== Editor State ========== */
 static struct {
-    char **lines;           /* Array of line strings */
+    line_t *lines;          /* Array of lines */
     int line_count;         /* Number of lines */
     int lines_alloc;        /* Allocated slots */
 
@@ -125,20 +292,81 @@ static struct {
 
     char filepath[256];     /* Current file path */
     char status[128];       /* Status line message */
-    char cmd_buf[CMD_BUF_SIZE];  /* Command buffer for : mode */
+    char cmd_buf[CMD_BUF_SIZE];  /* Command buffer for : and / modes */
     int cmd_len;            /* Command buffer length */
 
+    int search_dir;         /* 1 for /, -1 for ? */
+    int search_hl;          /* Highlight matches of the last pattern */
+    int search_row;         /* Cursor when the search started */
+    int search_col;
+
+    int syntax;             /* SYN_* language of the buffer */
+    int hl_valid;           /* Leading lines whose cached lexer state is current */
+
     int screen_rows;        /* Terminal rows */
     int screen_cols;        /* Terminal cols */
 } E;
 
+/* ========== Search Kernel ========== */
+/*
+ * Boyer-Moore-Horspool over line text in place. Single-byte patterns go
+ * straight to memchr, which libc vectorizes.
+ */
+static struct {
+    char text[CMD_BUF_SIZE];
+    int len;
+    int skip[256];          /* Shift for the byte under the window's last position */
+} s_pat;
+
+static void pat_compile(const char *p) {
+    int m = strlen(p);
+    memcpy(s_pat.text, p, m + 1);
+    s_pat.len = m;
+    for (int i = 0; i < 256; i++) s_pat.skip[i] = m;
+    for (int i = 0; i < m - 1; i++) s_pat.skip[(unsigned char)p[i]] = m - 1 - i;
+}
+
+/* First match in hay[from, n), or -1 */
+static int pat_find(const char *hay, int n, int from) {
+    int m = s_pat.len;
+    if (m == 0 || from < 0 || n - from < m) return -1;
+    if (m == 1) {
+        const char *hit = memchr(hay + from, s_pat.text[0], n - from);
+        return hit ? (int)(hit - hay) : -1;
+    }
+    const char *pat = s_pat.text;
+    char last = pat[m - 1];
+    for (int i = from; i <= n - m; ) {
+        char c = hay[i + m - 1];
+        if (c == last && memcmp(hay + i, pat, m - 1) == 0) return i;
+        i += s_pat.skip[(unsigned char)c];
+    }
+    return -1;
+}
+
+/* Last match starting before limit, or -1 */
+static int pat_find_last(const char *hay, int n, int limit) {
+    int found = -1;
+    for (int col = 0; (col = pat_find(hay, n, col)) >= 0 && col < limit; col++) {
+        found = col;
+    }
+    return found;
+}
+
 /* ========== Output Buffering ========== */
 static char s_out_buf[8192];
 static int s_out_pos = 0;
+static int s_out_fd = STDOUT_FILENO;   /* -1: count only, for headless replays */
+static long s_out_total;                /* Bytes emitted so far */
+
+static void out_write(const char *s, int len) {
+    s_out_total += len;
+    if (s_out_fd >= 0) write(s_out_fd, s, len);
+}
 
 static void out_flush(void) {
     if (s_out_pos > 0) {
-        write(STDOUT_FILENO, s_out_buf, s_out_pos);
+        out_write(s_out_buf, s_out_pos);
         s_out_pos = 0;
     }
 }
@@ -151,7 +379,7 @@ static void out_str(const char *s) {
         s_out_pos += len;
     } else {
         out_flush();
-        write(STDOUT_FILENO, s, len);
+        out_write(s, len);
     }
 }
 
@@ -160,6 +388,17 @@ static void out_char(char c) {
     s_out_buf[s_out_pos++] = c;
 }
 
+/* Screen cells hold a character's UTF-8 bytes, first byte lowest */
+static void out_cells(const unsigned *cells, int n) {
+    for (int i = 0; i < n; i++) {
+        unsigned c = cells[i];
+        do {
+            out_char((char)c);
+            c >>= 8;
+        } while (c);
+    }
+}
+
 static void out_int(int n) {
     char buf[16];
     snprintf(buf, sizeof(buf), "%d", n);
@@ -174,346 +413,2699 @@ static void out_goto(int row, int col) {
     out_char('H');
 }
 
-/* ========== Line Management ========== */
-static char *line_dup(const char *s) {
-    if (!s) s = "";
-    size_t len = strlen(s);
-    char *p = malloc(len + 1);
-    if (p) memcpy(p, s, len + 1);
-    return p;
+/* ========== Damage Tracking ========== */
+/*
+ * s_shadow holds what the terminal currently shows, one character per cell
+ * (its UTF-8 bytes packed, first byte lowest) plus an attribute byte.
+ * Editing primitives flag the screen rows they touch; draw_screen()
+ * re-renders only flagged rows and emits just the cells that differ.
+ */
+enum {
+    ATTR_NONE, ATTR_STATUS, ATTR_MATCH,
+    /* Syntax colours; foreground only, so blanks look the same in any */
+    ATTR_COMMENT, ATTR_STRING, ATTR_NUMBER, ATTR_KEYWORD, ATTR_TYPE, ATTR_PREPROC,
+};
+#define ATTR_UNKNOWN    0xFF    /* Shadow only: terminal contents not known */
+
+/* Every SGR starts from a reset, so any attribute switch is one escape */
+static const char *const s_attr_sgr[] = {
+    "\033[0m",          /* ATTR_NONE */
+    "\033[0;7m",        /* ATTR_STATUS */
+    "\033[0;30;43m",    /* ATTR_MATCH */
+    "\033[0;36m",       /* ATTR_COMMENT */
+    "\033[0;31m",       /* ATTR_STRING */
+    "\033[0;35m",       /* ATTR_NUMBER */
+    "\033[0;33m",       /* ATTR_KEYWORD */
+    "\033[0;32m",       /* ATTR_TYPE */
+    "\033[0;94m",       /* ATTR_PREPROC */
+};
+
+static unsigned *s_shadow;      /* screen_rows x screen_cols last drawn cells */
+static unsigned char *s_shadow_attr;
+static unsigned *s_row_buf;     /* Scratch row being composed */
+static unsigned char *s_row_attr;   /* Per byte while lexing, then per cell */
+static char *s_row_text;        /* Visible bytes of the row being composed */
+static unsigned char *s_row_dirty;  /* Per text row: needs re-render */
+static int s_drawn_top = -1;    /* Viewport of the last draw */
+static int s_drawn_left = -1;
+static int s_drawn_crow = -1;   /* Last emitted cursor position */
+static int s_drawn_ccol = -1;
+static int s_cursor_hidden;     /* Cursor hidden during this frame */
+
+static void mark_all_dirty(void) {
+    memset(s_row_dirty, 1, E.screen_rows);
 }
 
-static void ensure_lines_capacity(int needed) {
-    if (needed <= E.lines_alloc) return;
-    int new_alloc = E.lines_alloc ? E.lines_alloc * 2 : 64;
-    while (new_alloc < needed) new_alloc *= 2;
-    E.lines = realloc(E.lines, new_alloc * sizeof(char *));
-    E.lines_alloc = new_alloc;
+static void mark_line_dirty(int file_row) {
+    int y = file_row - E.top_line;
+    if (y >= 0 && y < E.screen_rows - 1) s_row_dirty[y] = 1;
 }
 
-static void insert_line_at(int idx, const char *text) {
-    ensure_lines_capacity(E.line_count + 1);
-    for (int i = E.line_count; i > idx; i--) {
-        E.lines[i] = E.lines[i - 1];
+/* Rows at and below file_row shift on line insert/delete */
+static void mark_lines_dirty_from(int file_row) {
+    int y = file_row - E.top_line;
+    if (y < 0) y = 0;
+    for (; y < E.screen_rows - 1; y++) s_row_dirty[y] = 1;
+}
+
+static void screen_init(void) {
+    int cells = E.screen_rows * E.screen_cols;
+    s_shadow = malloc(cells * sizeof(*s_shadow));
+    s_shadow_attr = malloc(cells);
+    s_row_buf = malloc(E.screen_cols * sizeof(*s_row_buf));
+    s_row_attr = malloc(E.screen_cols * UTF_MAX);
+    s_row_text = malloc(E.screen_cols * UTF_MAX);
+    s_row_dirty = malloc(E.screen_rows);
+    for (int i = 0; i < cells; i++) s_shadow[i] = ' ';  /* A freshly cleared screen */
+    memset(s_shadow_attr, ATTR_NONE, cells);
+    mark_all_dirty();
+}
+
+static void screen_free(void) {
+    free(s_shadow);
+    free(s_shadow_attr);
+    free(s_row_buf);
+    free(s_row_attr);
+    free(s_row_text);
+    free(s_row_dirty);
+}
+
+/* ========== File Source ========== */
+/*
+ * The file being edited is read lazily. POSIX maps it; ESP32 (or a file
+ * that cannot be mapped) pages it through SRC_SLOTS windows of SRC_PAGE
+ * bytes. Pointers returned here stay valid for the next SRC_SLOTS - 1
+ * source reads, which is all any caller holds them for.
+ */
+typedef struct {
+    FILE *f;                /* Paged source, or NULL */
+    const char *map;        /* Mapped source, or NULL */
+    int fd;                 /* Descriptor behind map, or -1 */
+    long size;              /* Source file size */
+    long scan_off;          /* Lines are indexed up to here */
+    struct {
+        char *buf;
+        long off;
+        long len;
+        unsigned int used;  /* LRU stamp */
+    } slot[SRC_SLOTS];
+    unsigned int clock;
+} src_t;
+
+static src_t s_src;
+
+static int src_open(const char *path) {
+    memset(&s_src, 0, sizeof(s_src));
+    s_src.fd = -1;
+#ifndef __XTENSA__
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (m != MAP_FAILED) {
+            s_src.map = m;
+            s_src.size = st.st_size;
+            s_src.fd = fd;      /* Kept for copy_file_range on save */
+            return 1;
+        }
     }
-    E.lines[idx] = line_dup(text);
-    E.line_count++;
+    close(fd);
+#endif
+    s_src.f = fopen(path, "r");
+    if (!s_src.f) return 0;
+    fseek(s_src.f, 0, SEEK_END);
+    s_src.size = ftell(s_src.f);
+    return 1;
 }
 
-static void delete_line_at(int idx) {
-    if (idx < 0 || idx >= E.line_count) return;
-    free(E.lines[idx]);
-    for (int i = idx; i < E.line_count - 1; i++) {
-        E.lines[i] = E.lines[i + 1];
+static void src_close(void) {
+#ifndef __XTENSA__
+    if (s_src.map) munmap((void *)s_src.map, s_src.size);
+#endif
+    if (s_src.fd >= 0) close(s_src.fd);
+    if (s_src.f) fclose(s_src.f);
+    for (int i = 0; i < SRC_SLOTS; i++) free(s_src.slot[i].buf);
+    memset(&s_src, 0, sizeof(s_src));
+    s_src.fd = -1;
+}
+
+/* Page [start, start + len) into the least recently used window */
+static const char *src_load(long start, long len) {
+    int victim = 0;
+    for (int i = 1; i < SRC_SLOTS; i++) {
+        if (s_src.slot[i].used < s_src.slot[victim].used) victim = i;
     }
-    E.line_count--;
-    if (E.line_count == 0) {
-        insert_line_at(0, "");
+    long cap = (len + SRC_PAGE - 1) & ~(long)(SRC_PAGE - 1);
+    if (start + cap > s_src.size) cap = s_src.size - start;
+    if (cap > s_src.slot[victim].len || !s_src.slot[victim].buf) {
+        free(s_src.slot[victim].buf);
+        s_src.slot[victim].buf = malloc(cap);
     }
+    fseek(s_src.f, start, SEEK_SET);
+    s_src.slot[victim].len = fread(s_src.slot[victim].buf, 1, cap, s_src.f);
+    s_src.slot[victim].off = start;
+    s_src.slot[victim].used = ++s_src.clock;
+    return s_src.slot[victim].buf;
 }
 
-static void free_all_lines(void) {
-    for (int i = 0; i < E.line_count; i++) {
-        free(E.lines[i]);
+/* Exactly len contiguous bytes at off */
+static const char *src_text(long off, long len) {
+    if (s_src.map) return s_src.map + off;
+    for (int i = 0; i < SRC_SLOTS; i++) {
+        if (s_src.slot[i].buf && off >= s_src.slot[i].off &&
+            off + len <= s_src.slot[i].off + s_src.slot[i].len) {
+            s_src.slot[i].used = ++s_src.clock;
+            return s_src.slot[i].buf + (off - s_src.slot[i].off);
+        }
     }
-    free(E.lines);
-    E.lines = NULL;
-    E.line_count = 0;
-    E.lines_alloc = 0;
+    long start = off & ~(long)(SRC_PAGE - 1);
+    return src_load(start, off + len - start) + (off - start);
 }
 
-/* ========== File I/O ========== */
-static int load_file(const char *path) {
-    FILE *f = fopen(path, "r");
-    if (!f) {
-        /* New file - start with empty line */
-        insert_line_at(0, "");
-        snprintf(E.status, sizeof(E.status), "[New File]");
-        return 1;
+/* Whatever is contiguous at off (at least one byte); for scanning */
+static const char *src_span(long off, long *avail) {
+    if (s_src.map) {
+        *avail = s_src.size - off;
+        return s_src.map + off;
     }
-
-    char line[MAX_LINE_LEN];
-    while (fgets(line, sizeof(line), f)) {
-        /* Strip trailing newline/CR */
-        size_t len = strlen(line);
-        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
-            line[--len] = '\0';
+    for (int i = 0; i < SRC_SLOTS; i++) {
+        if (s_src.slot[i].buf && off >= s_src.slot[i].off &&
+            off < s_src.slot[i].off + s_src.slot[i].len) {
+            s_src.slot[i].used = ++s_src.clock;
+            *avail = s_src.slot[i].off + s_src.slot[i].len - off;
+            return s_src.slot[i].buf + (off - s_src.slot[i].off);
         }
-        insert_line_at(E.line_count, line);
     }
-    fclose(f);
+    long start = off & ~(long)(SRC_PAGE - 1);
+    const char *p = src_load(start, SRC_PAGE);
+    *avail = s_src.size - off;
+    if (*avail > start + SRC_PAGE - off) *avail = start + SRC_PAGE - off;
+    return p + (off - start);
+}
 
-    if (E.line_count == 0) {
-        insert_line_at(0, "");
-    }
+/* ========== Undo Journal ========== */
+/*
+ * Edits are journaled as deltas in one fixed arena: records from 0 to cur
+ * can be undone, records from cur to top redone. Each record is followed by
+ * its text (padded to 4 bytes) and its total size, so the arena can be
+ * walked in both directions. When the budget runs out, the oldest changes
+ * are dropped by sliding the arena down; nothing is freed per edit.
+ */
+enum { UNDO_INSERT, UNDO_ERASE, UNDO_LINE_ADD, UNDO_LINE_DEL };   /* Line ops: col = count */
+#define UNDO_OP_MASK    0x0F
+#define UNDO_GROUP      0x80    /* First record of one undoable change */
 
-    snprintf(E.status, sizeof(E.status), "\"%s\" %d lines", path, E.line_count);
-    return 1;
+typedef struct {
+    int op;                 /* UNDO_* | UNDO_GROUP */
+    int row;
+    int col;
+    int len;                /* Text bytes following the header */
+} undo_rec_t;
+
+typedef struct {
+    char *arena;
+    int top;                /* End of journaled records */
+    int cur;                /* Undo position */
+    int last;               /* Latest record of the current change, or -1 */
+    int saved;              /* cur at the last save, -1 once dropped */
+    int new_group;          /* Next record starts a new change */
+    int lost;               /* Current change outgrew the budget */
+    int replaying;          /* Applying undo/redo: do not journal */
+} undo_t;
+
+static undo_t s_undo;
+
+/* Swap file of the live buffer; records queue in s_swap_out */
+typedef struct {
+    int armed;              /* Edits are logged */
+    int created;            /* Our swap file exists, header written */
+    int found;              /* A swap file from an earlier session awaits r/e/d */
+} swap_t;
+
+static swap_t s_swap;
+static void swap_log(int op, int row, int col, const char *text, int len);
+
+static int undo_rec_size(int len) {
+    return (((int)sizeof(undo_rec_t) + len + 3) & ~3) + (int)sizeof(int);
 }
 
-static int save_file(const char *path) {
-    if (!path || !path[0]) path = E.filepath;
-    if (!path || !path[0]) {
-        snprintf(E.status, sizeof(E.status), "No filename");
-        return 0;
+static undo_rec_t *undo_at(int off) {
+    return (undo_rec_t *)(s_undo.arena + off);
+}
+
+static void undo_seal(int off) {
+    int size = undo_rec_size(undo_at(off)->len);
+    memcpy(s_undo.arena + off + size - sizeof(int), &size, sizeof(int));
+}
+
+static void undo_reset(void) {
+    s_undo.top = s_undo.cur = s_undo.saved = 0;
+    s_undo.last = -1;
+    s_undo.new_group = 1;
+    s_undo.lost = 0;
+}
+
+static void undo_boundary(void) {
+    s_undo.new_group = 1;
+}
+
+/* Slide out the oldest whole changes until need more bytes fit */
+static int undo_make_room(int need) {
+    int off = 0;
+    while (off < s_undo.top) {
+        if ((undo_at(off)->op & UNDO_GROUP) && off > 0 &&
+            s_undo.top - off + need <= UNDO_BUDGET) {
+            break;
+        }
+        off += undo_rec_size(undo_at(off)->len);
     }
+    if (off >= s_undo.top) {
+        /* Nothing older is left; a change in progress cannot be split */
+        if (s_undo.last >= 0 || need > UNDO_BUDGET) return 0;
+        off = s_undo.top;
+    }
+    memmove(s_undo.arena, s_undo.arena + off, s_undo.top - off);
+    s_undo.top -= off;
+    s_undo.cur -= off;
+    if (s_undo.last >= 0) s_undo.last -= off;
+    s_undo.saved = s_undo.saved >= off ? s_undo.saved - off : -1;
+    return 1;
+}
 
-    FILE *f = fopen(path, "w");
-    if (!f) {
-        snprintf(E.status, sizeof(E.status), "Cannot write: %s", path);
-        return 0;
+/* Start journaling an edit; returns 0 if it is not to be recorded */
+static int undo_begin(void) {
+    if (s_undo.replaying) return 0;
+    if (!s_undo.arena) {
+        s_undo.arena = malloc(UNDO_BUDGET);
+        if (!s_undo.arena) return 0;
     }
 
-    for (int i = 0; i < E.line_count; i++) {
-        fprintf(f, "%s\n", E.lines[i]);
+    /* A new edit forgets the redo branch */
+    s_undo.top = s_undo.cur;
+    if (s_undo.saved > s_undo.cur) s_undo.saved = -1;
+
+    if (s_undo.new_group) {
+        s_undo.new_group = 0;
+        s_undo.lost = 0;
+        s_undo.last = -1;
     }
-    fclose(f);
+    return !s_undo.lost;
+}
 
-    E.modified = 0;
-    if (path != E.filepath) {
-        strncpy(E.filepath, path, sizeof(E.filepath) - 1);
+/*
+ * Append a record and return where its len bytes of text go, or NULL if
+ * it is not journaled. The caller fills the text in before the next
+ * journal call.
+ */
+static char *undo_reserve(int op, int row, int col, int len) {
+    if (!undo_begin()) return NULL;
+
+    int size = undo_rec_size(len);
+    if (s_undo.top + size > UNDO_BUDGET && !undo_make_room(size)) {
+        /* This change alone exceeds the budget; it cannot be undone */
+        s_undo.lost = 1;
+        s_undo.top = s_undo.cur = 0;
+        s_undo.last = -1;
+        s_undo.saved = -1;
+        return NULL;
     }
-    snprintf(E.status, sizeof(E.status), "\"%s\" %d lines written", E.filepath, E.line_count);
-    return 1;
+
+    undo_rec_t *r = undo_at(s_undo.top);
+    r->op = op | (s_undo.last < 0 ? UNDO_GROUP : 0);
+    r->row = row;
+    r->col = col;
+    r->len = len;
+    undo_seal(s_undo.top);
+    s_undo.last = s_undo.top;
+    s_undo.top += size;
+    s_undo.cur = s_undo.top;
+    return (char *)(r + 1);
 }
 
-/* ========== Input Handling ========== */
-static int read_key(void) {
-    static char esc_buf[ESC_BUF_SIZE];
-    static int esc_len = 0;
-
-    char c;
-    int n = read(STDIN_FILENO, &c, 1);
-    if (n <= 0) return KEY_NONE;
-
-    /* Handle escape sequences */
-    if (esc_len > 0 || c == 27) {
-        esc_buf[esc_len++] = c;
-
-        /* Try to match complete sequences */
-        if (esc_len >= 3) {
-            if (memcmp(esc_buf, "\033[A", 3) == 0) { esc_len = 0; return KEY_UP; }
-            if (memcmp(esc_buf, "\033[B", 3) == 0) { esc_len = 0; return KEY_DOWN; }
-            if (memcmp(esc_buf, "\033[C", 3) == 0) { esc_len = 0; return KEY_RIGHT; }
-            if (memcmp(esc_buf, "\033[D", 3) == 0) { esc_len = 0; return KEY_LEFT; }
-            if (memcmp(esc_buf, "\033[H", 3) == 0) { esc_len = 0; return KEY_HOME; }
-            if (memcmp(esc_buf, "\033[F", 3) == 0) { esc_len = 0; return KEY_END; }
-            if (memcmp(esc_buf, "\033OH", 3) == 0) { esc_len = 0; return KEY_HOME; }
-            if (memcmp(esc_buf, "\033OF", 3) == 0) { esc_len = 0; return KEY_END; }
-        }
-        if (esc_len >= 4) {
-            if (memcmp(esc_buf, "\033[3~", 4) == 0) { esc_len = 0; return KEY_DELETE; }
-            if (memcmp(esc_buf, "\033[1~", 4) == 0) { esc_len = 0; return KEY_HOME; }
-            if (memcmp(esc_buf, "\033[4~", 4) == 0) { esc_len = 0; return KEY_END; }
-        }
-
-        /* Plain ESC (no more bytes coming) */
-        if (esc_len == 1) {
-            /* Check for more input */
-            char c2;
-            int n2 = read(STDIN_FILENO, &c2, 1);
-            if (n2 <= 0) {
-                esc_len = 0;
-                return KEY_ESC;
-            }
-            esc_buf[esc_len++] = c2;
+static void undo_record(int op, int row, int col, const char *text, int len) {
+    swap_log(op, row, col, text, len);
+
+    /* Typing extends the previous insert in place */
+    if (op == UNDO_INSERT && undo_begin() && s_undo.last >= 0) {
+        undo_rec_t *r = undo_at(s_undo.last);
+        if ((r->op & UNDO_OP_MASK) == UNDO_INSERT && r->row == row &&
+            r->col + r->len == col &&
+            s_undo.last + undo_rec_size(r->len + len) <= UNDO_BUDGET) {
+            memcpy((char *)(r + 1) + r->len, text, len);
+            r->len += len;
+            undo_seal(s_undo.last);
+            s_undo.top = s_undo.cur = s_undo.last + undo_rec_size(r->len);
+            return;
         }
+    }
+
+    char *dst = undo_reserve(op, row, col, len);
+    if (dst) memcpy(dst, text, len);
+}
+
+/* ========== Line Pool ========== */
+/*
+ * Line buffers of all open buffers come from one pool. Capacities up to
+ * POOL_MAX_CAP are rounded to POOL_GRAIN, and each size class carves its
+ * blocks out of POOL_SLAB-byte slabs and recycles them through a free
+ * list, so short lines pay neither a heap header nor heap fragmentation.
+ * Slabs are kept for reuse until exit. Longer lines use the heap.
+ */
+#define POOL_GRAIN      16
+#define POOL_MAX_CAP    256
+#define POOL_CLASSES    (POOL_MAX_CAP / POOL_GRAIN)
+
+static struct {
+    void *free_list[POOL_CLASSES];
+    char *carve[POOL_CLASSES];      /* Unused tail of the class's newest slab */
+    int carve_left[POOL_CLASSES];
+    void *slabs;                    /* Chain of every slab, for pool_release() */
+    long slab_bytes;
+    long used_bytes;                /* Handed out and not yet freed */
+} s_pool;
 
-        /* Partial sequence or unknown - keep waiting or reset */
-        if (esc_len >= ESC_BUF_SIZE - 1) {
-            esc_len = 0;  /* Buffer overflow, reset */
+/* Capacity actually allocated for n bytes */
+static int pool_cap(int n) {
+    if (n > POOL_MAX_CAP) return n;
+    return (n + POOL_GRAIN - 1) & ~(POOL_GRAIN - 1);
+}
+
+/* cap must come from pool_cap() */
+static char *pool_alloc(int cap) {
+    if (cap > POOL_MAX_CAP) return malloc(cap);
+    int c = cap / POOL_GRAIN - 1;
+    char *p = s_pool.free_list[c];
+    if (p) {
+        s_pool.free_list[c] = *(void **)p;
+    } else {
+        if (s_pool.carve_left[c] < cap) {
+            char *slab = malloc(POOL_SLAB);
+            if (!slab) return NULL;
+            *(void **)slab = s_pool.slabs;
+            s_pool.slabs = slab;
+            s_pool.slab_bytes += POOL_SLAB;
+            s_pool.carve[c] = slab + POOL_GRAIN;    /* Link word, grain-aligned */
+            s_pool.carve_left[c] = POOL_SLAB - POOL_GRAIN;
         }
-        return KEY_NONE;
+        p = s_pool.carve[c];
+        s_pool.carve[c] += cap;
+        s_pool.carve_left[c] -= cap;
     }
+    s_pool.used_bytes += cap;
+    return p;
+}
 
-    /* Regular keys */
-    if (c == 127 || c == 8) return KEY_BACKSPACE;
-    if (c == '\r' || c == '\n') return KEY_ENTER;
-    if (c >= 32 && c < 127) return c;
+static void pool_free(char *p, int cap) {
+    if (!p) return;
+    if (cap > POOL_MAX_CAP) {
+        free(p);
+        return;
+    }
+    int c = cap / POOL_GRAIN - 1;
+    *(void **)p = s_pool.free_list[c];
+    s_pool.free_list[c] = p;
+    s_pool.used_bytes -= cap;
+}
 
-    return KEY_NONE;
+static void pool_release(void) {
+    while (s_pool.slabs) {
+        void *next = *(void **)s_pool.slabs;
+        free(s_pool.slabs);
+        s_pool.slabs = next;
+    }
+    memset(&s_pool, 0, sizeof(s_pool));
 }
 
-/* ========== Cursor Movement ========== */
+/* ========== Line Management ========== */
 static int line_len(int row) {
     if (row < 0 || row >= E.line_count) return 0;
-    return strlen(E.lines[row]);
+    return E.lines[row].len;
 }
 
-static void clamp_cursor(void) {
-    if (E.cur_row < 0) E.cur_row = 0;
-    if (E.cur_row >= E.line_count) E.cur_row = E.line_count - 1;
-    if (E.cur_row < 0) E.cur_row = 0;
-
-    int len = line_len(E.cur_row);
-    if (E.mode == MODE_INSERT) {
-        /* In insert mode, can be at end of line */
-        if (E.cur_col > len) E.cur_col = len;
-    } else {
-        /* In normal mode, can't be past last char */
-        if (len == 0) {
-            E.cur_col = 0;
-        } else if (E.cur_col >= len) {
-            E.cur_col = len - 1;
-        }
+static void gap_move(line_t *l, int pos) {
+    int gap_len = l->cap - l->len;
+    if (pos < l->gap) {
+        memmove(l->buf + pos + gap_len, l->buf + pos, l->gap - pos);
+    } else if (pos > l->gap) {
+        memmove(l->buf + l->gap, l->buf + l->gap + gap_len, pos - l->gap);
     }
-    if (E.cur_col < 0) E.cur_col = 0;
+    l->gap = pos;
 }
 
-static void move_up(void) {
-    if (E.cur_row > 0) E.cur_row--;
-    clamp_cursor();
+/* Make room for n more bytes; the gap stays where it is */
+static void gap_reserve(line_t *l, int n) {
+    if (l->cap - l->len >= n) return;
+    int new_cap = l->cap ? l->cap * 2 : LINE_MIN_CAP;
+    while (new_cap < l->len + n) new_cap *= 2;
+    new_cap = pool_cap(new_cap);
+    char *buf = pool_alloc(new_cap);
+    if (l->cap) {
+        int tail = l->len - l->gap;
+        memcpy(buf, l->buf, l->gap);
+        memcpy(buf + new_cap - tail, l->buf + l->cap - tail, tail);
+        pool_free(l->buf, l->cap);
+    }
+    l->buf = buf;
+    l->cap = new_cap;
 }
 
-static void move_down(void) {
-    if (E.cur_row < E.line_count - 1) E.cur_row++;
-    clamp_cursor();
+/* Copy a source-backed line into its own buffer before the first edit */
+static void line_materialize(line_t *l) {
+    if (!l->cap && l->len) {
+        const char *text = src_text(l->off, l->len);
+        l->cap = pool_cap(l->len);
+        l->buf = pool_alloc(l->cap);
+        memcpy(l->buf, text, l->len);
+        l->gap = l->len;
+    }
+    l->off = -1;
 }
 
-static void move_left(void) {
-    if (E.cur_col > 0) E.cur_col--;
-    clamp_cursor();
+/* Contiguous text of a line (closes the gap at the end) */
+static const char *line_text(int row) {
+    line_t *l = &E.lines[row];
+    if (!l->cap) return l->len ? src_text(l->off, l->len) : "";
+    gap_move(l, l->len);
+    return l->buf;
 }
 
-static void move_right(void) {
-    E.cur_col++;
-    clamp_cursor();
+/* Byte i of row, read around the gap without moving it */
+static unsigned char line_byte(int row, int i) {
+    const line_t *l = &E.lines[row];
+    if (!l->cap) return *src_text(l->off + i, 1);
+    return l->buf[i < l->gap ? i : i + l->cap - l->len];
 }
 
-/* ========== Text Editing ========== */
-static void insert_char(char c) {
-    char *line = E.lines[E.cur_row];
-    int len = strlen(line);
-
-    char *new_line = malloc(len + 2);
-    memcpy(new_line, line, E.cur_col);
-    new_line[E.cur_col] = c;
-    memcpy(new_line + E.cur_col + 1, line + E.cur_col, len - E.cur_col + 1);
-
-    free(E.lines[E.cur_row]);
-    E.lines[E.cur_row] = new_line;
-    E.cur_col++;
-    E.modified = 1;
+/* Copy n bytes starting at col into dst, reading around the gap */
+static void line_copy(int row, int col, int n, char *dst) {
+    const line_t *l = &E.lines[row];
+    if (!l->cap) {
+        if (n > 0) memcpy(dst, src_text(l->off + col, n), n);  /* No source with no file */
+        return;
+    }
+    if (col < l->gap) {
+        int head = l->gap - col;
+        if (head > n) head = n;
+        memcpy(dst, l->buf + col, head);
+        dst += head; col += head; n -= head;
+    }
+    if (n > 0) memcpy(dst, l->buf + col + l->cap - l->len, n);
 }
 
-static void delete_char_at(int col) {
-    char *line = E.lines[E.cur_row];
-    int len = strlen(line);
-    if (col < 0 || col >= len) return;
+/* Contiguous text of a line for reading only: with the gap mid-line it
+ * is copied out rather than closed, so a redraw of the line being typed
+ * into does not undo the gap. Valid until the next call. */
+static char *s_peek;
+static int s_peek_cap;
 
-    memmove(line + col, line + col + 1, len - col);
-    E.modified = 1;
+static const char *line_peek(int row) {
+    const line_t *l = &E.lines[row];
+    if (!l->cap || l->gap == l->len) return line_text(row);
+    if (l->len > s_peek_cap) {
+        char *p = realloc(s_peek, l->len);
+        if (!p) return line_text(row);
+        s_peek = p;
+        s_peek_cap = l->len;
+    }
+    line_copy(row, 0, l->len, s_peek);
+    return s_peek;
 }
 
-static void backspace_char(void) {
-    if (E.cur_col > 0) {
-        E.cur_col--;
-        delete_char_at(E.cur_col);
-    } else if (E.cur_row > 0) {
-        /* Join with previous line */
-        int prev_len = line_len(E.cur_row - 1);
-        char *prev = E.lines[E.cur_row - 1];
-        char *curr = E.lines[E.cur_row];
+/*
+ * Text of row changed: its cached lexer state is stale and nothing from
+ * row down can be trusted until re-lexed.
+ */
+static void hl_invalidate(int row) {
+    E.lines[row].hl |= HL_DIRTY;
+    if (E.hl_valid > row) E.hl_valid = row;
+}
 
-        char *new_line = malloc(prev_len + strlen(curr) + 1);
-        strcpy(new_line, prev);
-        strcat(new_line, curr);
+static int utf_plain(const char *s, int n);
+static void utf_changed(int row, const char *s, int n);
+static void cmap_forget(int row);
 
-        free(E.lines[E.cur_row - 1]);
-        E.lines[E.cur_row - 1] = new_line;
+static void line_insert(int row, int col, const char *s, int n) {
+    line_t *l = &E.lines[row];
+    undo_record(UNDO_INSERT, row, col, s, n);
+    line_materialize(l);
+    gap_reserve(l, n);
+    gap_move(l, col);
+    memcpy(l->buf + col, s, n);
+    l->gap += n;
+    l->len += n;
+    hl_invalidate(row);
+    utf_changed(row, s, n);
+    mark_line_dirty(row);
+}
 
-        delete_line_at(E.cur_row);
-        E.cur_row--;
-        E.cur_col = prev_len;
-        E.modified = 1;
-    }
+static void line_erase(int row, int col, int n) {
+    line_t *l = &E.lines[row];
+    line_materialize(l);
+    gap_move(l, col);
+    undo_record(UNDO_ERASE, row, col, l->buf + col + l->cap - l->len, n);
+    l->len -= n;
+    hl_invalidate(row);
+    utf_changed(row, NULL, 0);
+    mark_line_dirty(row);
 }
 
-static void insert_newline(void) {
-    char *line = E.lines[E.cur_row];
-    char *rest = line_dup(line + E.cur_col);
+/* Replace del bytes at col with s: one gap move for both halves */
+static void line_splice(int row, int col, int del, const char *s, int n) {
+    line_t *l = &E.lines[row];
+    line_materialize(l);
+    gap_move(l, col);
+    undo_record(UNDO_ERASE, row, col, l->buf + col + l->cap - l->len, del);
+    l->len -= del;
+    undo_record(UNDO_INSERT, row, col, s, n);
+    gap_reserve(l, n);
+    memcpy(l->buf + col, s, n);
+    l->gap += n;
+    l->len += n;
+    hl_invalidate(row);
+    utf_changed(row, NULL, 0);
+    utf_changed(row, s, n);
+    mark_line_dirty(row);
+}
 
-    line[E.cur_col] = '\0';
-    insert_line_at(E.cur_row + 1, rest);
-    free(rest);
+static void line_truncate(int row, int col) {
+    line_erase(row, col, line_len(row) - col);
+}
 
-    E.cur_row++;
-    E.cur_col = 0;
-    E.modified = 1;
+static int line_exists(int row);
+
+static void ensure_lines_capacity(int needed) {
+    if (needed <= E.lines_alloc) return;
+    int new_alloc = E.lines_alloc ? E.lines_alloc * 2 : 64;
+    while (new_alloc < needed) new_alloc *= 2;
+    E.lines = realloc(E.lines, new_alloc * sizeof(line_t));
+    E.lines_alloc = new_alloc;
 }
 
-/* ========== Screen Rendering ========== */
-static void adjust_viewport(void) {
-    int text_rows = E.screen_rows - 1;  /* Reserve 1 for status */
-    int text_cols = E.screen_cols;
+/* Bytes of n lines from row joined with '\n' */
+static long lines_size(int row, int n) {
+    long size = n - 1;
+    for (int i = 0; i < n; i++) size += E.lines[row + i].len;
+    return size;
+}
 
-    /* Vertical scroll */
-    if (E.cur_row < E.top_line) {
-        E.top_line = E.cur_row;
-    }
-    if (E.cur_row >= E.top_line + text_rows) {
-        E.top_line = E.cur_row - text_rows + 1;
+static void lines_copy_out(int row, int n, char *dst) {
+    for (int i = 0; i < n; i++) {
+        int len = line_len(row + i);
+        line_copy(row + i, 0, len, dst);
+        dst += len;
+        if (i < n - 1) *dst++ = '\n';
     }
+}
 
-    /* Horizontal scroll */
-    if (E.cur_col < E.left_col) {
-        E.left_col = E.cur_col;
-    }
-    if (E.cur_col >= E.left_col + text_cols) {
-        E.left_col = E.cur_col - text_cols + 1;
+/*
+ * Insert n lines at idx from text, where they are joined with '\n'. The
+ * line array shifts once for the whole block.
+ */
+static void insert_lines_at(int idx, const char *text, int len, int n) {
+    undo_record(UNDO_LINE_ADD, idx, n, text, len);
+    ensure_lines_capacity(E.line_count + n);
+    memmove(&E.lines[idx + n], &E.lines[idx], (E.line_count - idx) * sizeof(line_t));
+    const char *end = text + len;
+    for (int i = 0; i < n; i++) {
+        const char *nl = memchr(text, '\n', end - text);
+        int size = nl ? nl - text : end - text;
+        line_t *l = &E.lines[idx + i];
+        l->cap = pool_cap(size);
+        l->buf = size ? pool_alloc(l->cap) : NULL;
+        if (size) memcpy(l->buf, text, size);
+        l->len = l->gap = size;
+        l->off = -1;
+        l->hl = HL_UNKNOWN;
+        l->utf = utf_plain(text, size) ? UTF_ASCII : UTF_MULTI;
+        text += size + 1;
     }
+    E.line_count += n;
+    hl_invalidate(idx);
+    cmap_forget(idx);
+    mark_lines_dirty_from(idx);
 }
 
-static void draw_screen(void) {
-    int text_rows = E.screen_rows - 1;
-    int text_cols = E.screen_cols;
-
-    adjust_viewport();
-
-    out_str(ESC_HOME);
-    out_str(ESC_CURSOR_HIDE);
+static void insert_line_at(int idx, const char *text, int len) {
+    insert_lines_at(idx, text, len, 1);
+}
 
-    /* Draw text lines */
-    for (int y = 0; y < text_rows; y++) {
-        int file_row = E.top_line + y;
+/* Delete up to n lines from idx with one shift of the line array */
+static void delete_lines_at(int idx, int n) {
+    if (idx < 0 || n <= 0 || !line_exists(idx)) return;
+    line_exists(idx + n - 1);
+    if (n > E.line_count - idx) n = E.line_count - idx;
 
-        out_goto(y, 0);
+    swap_log(UNDO_LINE_DEL, idx, n, NULL, 0);
+    char *dst = undo_reserve(UNDO_LINE_DEL, idx, n, lines_size(idx, n));
+    if (dst) lines_copy_out(idx, n, dst);
+    for (int i = idx; i < idx + n; i++) pool_free(E.lines[i].buf, E.lines[i].cap);
+    memmove(&E.lines[idx], &E.lines[idx + n], (E.line_count - idx - n) * sizeof(line_t));
+    E.line_count -= n;
+    if (E.hl_valid > idx) E.hl_valid = idx;
+    cmap_forget(idx);
+    mark_lines_dirty_from(idx);
+    /* Replayed history brings its own line back */
+    if (E.line_count == 0 && !s_undo.replaying && !line_exists(0)) {
+        insert_line_at(0, "", 0);
+    }
+}
 
-        if (file_row < E.line_count) {
-            const char *line = E.lines[file_row];
-            int len = strlen(line);
+static void delete_line_at(int idx) {
+    delete_lines_at(idx, 1);
+}
 
-            /* Draw visible portion of line */
-            int start = E.left_col;
-            if (start < len) {
-                int chars = len - start;
-                if (chars > text_cols) chars = text_cols;
-                for (int i = 0; i < chars; i++) {
-                    out_char(line[start + i]);
-                }
-                /* Clear rest of line */
-                for (int i = chars; i < text_cols; i++) {
-                    out_char(' ');
-                }
-            } else {
-                /* Line shorter than scroll offset */
-                for (int i = 0; i < text_cols; i++) {
-                    out_char(' ');
+static void free_all_lines(void) {
+    for (int i = 0; i < E.line_count; i++) {
+        pool_free(E.lines[i].buf, E.lines[i].cap);
+    }
+    free(E.lines);
+    E.lines = NULL;
+    E.line_count = 0;
+    E.lines_alloc = 0;
+    E.hl_valid = 0;
+}
+
+/* ========== File I/O ========== */
+/* Index the next source line; returns 0 once the whole file is indexed */
+static int index_next_line(void) {
+    long start = s_src.scan_off, end = start;
+    if (start >= s_src.size) return 0;
+
+    while (end < s_src.size) {
+        long avail;
+        const char *p = src_span(end, &avail);
+        const char *nl = memchr(p, '\n', avail);
+        if (nl) {
+            end += nl - p;
+            break;
+        }
+        end += avail;
+    }
+    s_src.scan_off = end + 1;
+
+    /* Strip trailing CRs like the newline itself */
+    long len = end - start;
+    while (len > 0 && *src_text(start + len - 1, 1) == '\r') len--;
+
+    ensure_lines_capacity(E.line_count + 1);
+    line_t *l = &E.lines[E.line_count++];
+    l->buf = NULL;
+    l->len = l->gap = len;
+    l->cap = 0;
+    l->off = start;
+    l->hl = HL_UNKNOWN;
+    l->utf = UTF_UNKNOWN;
+    mark_line_dirty(E.line_count - 1);
+    return 1;
+}
+
+/* Lines past the index are discovered on demand; this indexes up to row */
+static int line_exists(int row) {
+    while (row >= E.line_count) {
+        if (!index_next_line()) return 0;
+    }
+    return row >= 0;
+}
+
+static void index_all(void) {
+    while (index_next_line()) {}
+}
+
+static int load_file(const char *path) {
+    if (!src_open(path)) {
+        /* New file - start with empty line */
+        insert_line_at(0, "", 0);
+        snprintf(E.status, sizeof(E.status), "[New File]");
+        return 1;
+    }
+
+    /* Only the first line is indexed up front; the rest follows on demand */
+    if (!line_exists(0)) {
+        insert_line_at(0, "", 0);
+    }
+
+    snprintf(E.status, sizeof(E.status), "\"%s\" %ld bytes", path, s_src.size);
+    return 1;
+}
+
+/*
+ * Saving writes a temp file and renames it over the target. Runs of lines
+ * untouched since load are still contiguous in the source, so they go out
+ * as block copies (copy_file_range, or one write straight from the map);
+ * edited lines are batched into one buffer between those copies.
+ */
+static struct {
+    int fd;
+    char *buf;
+    int pos;
+} s_save;
+
+static int write_all(int fd, const char *p, long n) {
+    while (n > 0) {
+        long w = write(fd, p, n);
+        if (w <= 0) return 0;
+        p += w;
+        n -= w;
+    }
+    return 1;
+}
+
+static int save_flush(void) {
+    int ok = write_all(s_save.fd, s_save.buf, s_save.pos);
+    s_save.pos = 0;
+    return ok;
+}
+
+static int save_put(const char *p, long n) {
+    if (s_save.pos + n > SAVE_BUF_SIZE) {
+        if (!save_flush()) return 0;
+        if (n > SAVE_BUF_SIZE) return write_all(s_save.fd, p, n);
+    }
+    memcpy(s_save.buf + s_save.pos, p, n);
+    s_save.pos += n;
+    return 1;
+}
+
+/* Copy source bytes [off, off + n) to the output without formatting */
+static int save_copy(long off, long n) {
+    if (!save_flush()) return 0;
+#ifdef __linux__
+    if (s_src.fd >= 0) {
+        loff_t in = off;
+        while (n > 0) {
+            ssize_t w = copy_file_range(s_src.fd, &in, s_save.fd, NULL, n, 0);
+            if (w <= 0) break;  /* Unsupported here; finish from the map */
+            n -= w;
+        }
+        off = in;
+    }
+#endif
+    if (s_src.map) return write_all(s_save.fd, s_src.map + off, n);
+
+    /* Paged source: stream through the save buffer */
+    while (n > 0) {
+        long chunk = n < SAVE_BUF_SIZE ? n : SAVE_BUF_SIZE;
+        fseek(s_src.f, off, SEEK_SET);
+        if ((long)fread(s_save.buf, 1, chunk, s_src.f) != chunk) return 0;
+        if (!write_all(s_save.fd, s_save.buf, chunk)) return 0;
+        off += chunk;
+        n -= chunk;
+    }
+    return 1;
+}
+
+static int save_lines(void) {
+    for (int i = 0; i < E.line_count; ) {
+        const line_t *l = &E.lines[i];
+        if (l->off < 0) {
+            if (!save_put(line_text(i), l->len) || !save_put("\n", 1)) return 0;
+            i++;
+            continue;
+        }
+
+        /* Extend the run while the next line follows directly in the source */
+        int j = i;
+        while (j + 1 < E.line_count &&
+               E.lines[j + 1].off == E.lines[j].off + E.lines[j].len + 1) {
+            j++;
+        }
+        long end = E.lines[j].off + E.lines[j].len;
+        int has_nl = end < s_src.size && *src_text(end, 1) == '\n';
+        if (!save_copy(l->off, end + has_nl - l->off)) return 0;
+        if (!has_nl && !save_put("\n", 1)) return 0;
+        i = j + 1;
+    }
+    return save_flush();
+}
+
+/* The saved file now matches the buffer: back every line by it again */
+static void rebase_lines(void) {
+    long off = 0;
+    for (int i = 0; i < E.line_count; i++) {
+        line_t *l = &E.lines[i];
+        pool_free(l->buf, l->cap);
+        l->buf = NULL;
+        l->cap = 0;
+        l->gap = l->len;
+        l->off = off;
+        off += l->len + 1;
+    }
+}
+
+static void swap_discard(void);
+
+static int save_file(const char *path) {
+    if (!path || !path[0]) path = E.filepath;
+    if (!path || !path[0]) {
+        snprintf(E.status, sizeof(E.status), "No filename");
+        return 0;
+    }
+
+    /* Through a symlink, write beside the file it points at and replace
+     * that, so the link itself survives the rename */
+    char target[sizeof(E.filepath)];
+    snprintf(target, sizeof(target), "%s", path);
+#ifndef __XTENSA__
+    char *real = realpath(path, NULL);
+    if (real && strlen(real) < sizeof(target)) strcpy(target, real);
+    free(real);
+#endif
+
+    char tmp[sizeof(E.filepath) + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", target);
+    s_save.fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    s_save.buf = malloc(SAVE_BUF_SIZE);
+    s_save.pos = 0;
+    if (s_save.fd < 0 || !s_save.buf) {
+        if (s_save.fd >= 0) close(s_save.fd);
+        free(s_save.buf);
+        snprintf(E.status, sizeof(E.status), "Cannot write: %.100s", path);
+        return 0;
+    }
+#ifndef __XTENSA__
+    /* Keep the old file's mode and owner; only root can give a file
+     * away, and without the owner the set-id bits are dropped */
+    struct stat st;
+    if (stat(target, &st) == 0) {
+        mode_t mode = st.st_mode & 07777;
+        if (fchown(s_save.fd, st.st_uid, st.st_gid) != 0) mode &= 0777;
+        fchmod(s_save.fd, mode);
+    }
+#endif
+
+    long long t0 = plat_time_us();
+    index_all();
+    int ok = save_lines();
+#ifndef __XTENSA__
+    ok = ok && fsync(s_save.fd) == 0;
+#endif
+    ok = (close(s_save.fd) == 0) && ok;
+    free(s_save.buf);
+    if (!ok) {
+        remove(tmp);
+        snprintf(E.status, sizeof(E.status), "Cannot write: %.100s", path);
+        return 0;
+    }
+
+    /* Swap the new file in and re-point the lines at it */
+    const char *saved = target;
+    src_close();
+#ifdef __XTENSA__
+    remove(target); /* FAT rename does not replace an existing file */
+#endif
+    if (rename(tmp, target) != 0) saved = tmp;
+    src_open(saved);
+    s_src.scan_off = s_src.size;    /* Every line is already indexed */
+    rebase_lines();
+    long elapsed_ms = (long)(plat_time_us() - t0) / 1000;
+
+    E.modified = 0;
+    s_undo.saved = s_undo.cur;
+    swap_discard();
+    if (path != E.filepath) {
+        snprintf(E.filepath, sizeof(E.filepath), "%s", path);
+    }
+    s_swap.armed = !s_swap.found;
+    if (saved == tmp) {
+        snprintf(E.status, sizeof(E.status), "Rename failed, written to %.100s", tmp);
+        return 0;
+    }
+    unsigned long kb = s_src.size >> 10;
+    snprintf(E.status, sizeof(E.status), "\"%.60s\" %d lines, %ld bytes written, %lu KB/s",
+             E.filepath, E.line_count, s_src.size,
+             elapsed_ms > 0 ? kb * 1000 / elapsed_ms : kb * 1000);
+    return 1;
+}
+
+/* ========== Swap File ========== */
+/*
+ * Edits since the last save are appended to .name.swp next to the file, so
+ * a crash or brown-out loses at most the last idle period. A record is one
+ * primitive edit: the op byte, then row, col and len as varints, then the
+ * text for inserts. Deletions only need their extent. Records collect in
+ * a SWAP_CHUNK buffer that is written when it fills or once input has been
+ * idle for SWAP_IDLE_MS, never per keystroke. Each write opens, appends
+ * and closes, which commits it on FAT too. Saving removes the swap file.
+ * Opening a file that has one offers to replay it onto the file.
+ */
+static struct {
+    char buf[SWAP_CHUNK];
+    int len;
+    int ins;                /* Pending insert that typing extends, or -1 */
+    int ins_head;           /* Its header size */
+    int ins_row, ins_col, ins_len;
+    long long last_us;      /* When the newest record was queued */
+} s_swap_out = { .ins = -1 };
+
+static void swap_path(char *dst, int size) {
+    const char *base = strrchr(E.filepath, '/');
+    base = base ? base + 1 : E.filepath;
+    snprintf(dst, size, "%.*s.%s.swp", (int)(base - E.filepath), E.filepath, base);
+}
+
+/* Write to the swap file, creating it with its header the first time */
+static void swap_append(const char *a, int na, const char *b, int nb) {
+    char path[sizeof(E.filepath) + 8];
+    swap_path(path, sizeof(path));
+    int fd = open(path, O_WRONLY | O_CREAT | (s_swap.created ? O_APPEND : O_TRUNC), 0600);
+    if (fd < 0) {
+        s_swap.armed = 0;
+        snprintf(E.status, sizeof(E.status), "Cannot write %.100s", path);
+        return;
+    }
+    int ok = 1;
+    if (!s_swap.created) {
+        char head[32];
+        int n = snprintf(head, sizeof(head), "VISWAP1 %ld\n", s_src.size);
+        ok = write_all(fd, head, n);
+        s_swap.created = 1;
+    }
+    ok = ok && write_all(fd, a, na) && write_all(fd, b, nb);
+    if (close(fd) != 0 || !ok) {
+        s_swap.armed = 0;
+        snprintf(E.status, sizeof(E.status), "Swap file write failed");
+    }
+}
+
+static void swap_flush(void) {
+    if (s_swap_out.len) swap_append(s_swap_out.buf, s_swap_out.len, NULL, 0);
+    s_swap_out.len = 0;
+    s_swap_out.ins = -1;
+}
+
+/* Called when a wait for input timed out */
+static void swap_idle(void) {
+    if (s_swap_out.len && plat_time_us() - s_swap_out.last_us >= SWAP_IDLE_MS * 1000LL) {
+        swap_flush();
+    }
+}
+
+static int swap_put_uint(char *p, unsigned v) {
+    int n = 0;
+    while (v >= 0x80) {
+        p[n++] = (char)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (char)v;
+    return n;
+}
+
+static const char *swap_get_uint(const char *p, const char *end, int *v) {
+    unsigned x = 0;
+    for (int shift = 0; p < end && shift < 32; shift += 7) {
+        unsigned char c = *p++;
+        x |= (unsigned)(c & 0x7F) << shift;
+        if (!(c & 0x80)) {
+            *v = (int)x;
+            return *v >= 0 ? p : NULL;
+        }
+    }
+    return NULL;
+}
+
+static int swap_head(char *p, int op, int row, int col, int len) {
+    int n = 0;
+    p[n++] = (char)op;
+    n += swap_put_uint(p + n, row);
+    n += swap_put_uint(p + n, col);
+    n += swap_put_uint(p + n, len);
+    return n;
+}
+
+/* Queue one primitive edit; the journal calls this for every change */
+static void swap_log(int op, int row, int col, const char *text, int len) {
+    if (!s_swap.armed) return;
+    int tn = op == UNDO_INSERT || op == UNDO_LINE_ADD ? len : 0;
+    char head[16];
+    s_swap_out.last_us = plat_time_us();
+
+    /* Typing extends the pending insert; the header only grows at 128 bytes */
+    if (op == UNDO_INSERT && s_swap_out.ins >= 0 && row == s_swap_out.ins_row &&
+        col == s_swap_out.ins_col + s_swap_out.ins_len) {
+        int total = s_swap_out.ins_len + len;
+        int hn = swap_head(head, op, row, s_swap_out.ins_col, total);
+        if (s_swap_out.ins + hn + total <= SWAP_CHUNK) {
+            char *rec = s_swap_out.buf + s_swap_out.ins;
+            if (hn != s_swap_out.ins_head) {
+                memmove(rec + hn, rec + s_swap_out.ins_head, s_swap_out.ins_len);
+            }
+            memcpy(rec, head, hn);
+            memcpy(rec + hn + s_swap_out.ins_len, text, len);
+            s_swap_out.ins_head = hn;
+            s_swap_out.ins_len = total;
+            s_swap_out.len = s_swap_out.ins + hn + total;
+            return;
+        }
+    }
+
+    int hn = swap_head(head, op, row, col, len);
+    if (s_swap_out.len + hn + tn > SWAP_CHUNK) swap_flush();
+    if (hn + tn > SWAP_CHUNK) {
+        swap_append(head, hn, text, tn);    /* Big paste or block: straight out */
+        return;
+    }
+    s_swap_out.ins = -1;
+    if (op == UNDO_INSERT) {
+        s_swap_out.ins = s_swap_out.len;
+        s_swap_out.ins_head = hn;
+        s_swap_out.ins_row = row;
+        s_swap_out.ins_col = col;
+        s_swap_out.ins_len = len;
+    }
+    memcpy(s_swap_out.buf + s_swap_out.len, head, hn);
+    if (tn) memcpy(s_swap_out.buf + s_swap_out.len + hn, text, tn);   /* Deletes carry no text */
+    s_swap_out.len += hn + tn;
+}
+
+/* Forget the swap file: the edits it holds are saved or abandoned */
+static void swap_discard(void) {
+    s_swap_out.len = 0;
+    s_swap_out.ins = -1;
+    if (s_swap.created) {
+        char path[sizeof(E.filepath) + 8];
+        swap_path(path, sizeof(path));
+        remove(path);
+    }
+    s_swap.created = 0;
+}
+
+/* After loading: arm the buffer, or note a swap file left by a crash */
+static void swap_probe(void) {
+    char path[sizeof(E.filepath) + 8];
+    swap_path(path, sizeof(path));
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0) close(fd);
+    s_swap.found = fd >= 0;
+    s_swap.armed = !s_swap.found;
+}
+
+/*
+ * Replay the swap file onto the file as loaded. Records are applied with
+ * the same primitives that made them, outside the undo journal. A torn
+ * last record ends the replay; the file is then rewritten with the good
+ * part so that further edits append after it.
+ */
+static void swap_recover(void) {
+    char path[sizeof(E.filepath) + 8];
+    swap_path(path, sizeof(path));
+    FILE *f = fopen(path, "rb");
+    if (!f) return;
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *data = size > 0 ? malloc(size) : NULL;
+    long len = data ? (long)fread(data, 1, size, f) : 0;
+    fclose(f);
+
+    const char *end = data + len;
+    const char *p = data && len > 8 && memcmp(data, "VISWAP1 ", 8) == 0 ?
+                    memchr(data, '\n', len) : NULL;
+    if (!p || strtol(data + 8, NULL, 10) != s_src.size) {
+        snprintf(E.status, sizeof(E.status), "%.40s does not match %.40s; (d)elete it or (e)dit",
+                 path, E.filepath);
+        free(data);
+        return;
+    }
+
+    index_all();
+    s_undo.replaying = 1;
+    const char *good = ++p;
+    int count = 0, row = 0;
+    while (p < end) {
+        int op = *p++, col, n;
+        if (!(p = swap_get_uint(p, end, &row)) || !(p = swap_get_uint(p, end, &col)) ||
+            !(p = swap_get_uint(p, end, &n))) {
+            break;
+        }
+        int tn = op == UNDO_INSERT || op == UNDO_LINE_ADD ? n : 0;
+        if (end - p < tn) break;
+        if (op == UNDO_INSERT && row < E.line_count && col <= line_len(row)) {
+            line_insert(row, col, p, n);
+        } else if (op == UNDO_ERASE && row < E.line_count && col + n <= line_len(row)) {
+            line_erase(row, col, n);
+        } else if (op == UNDO_LINE_ADD && row <= E.line_count && col > 0) {
+            insert_lines_at(row, p, n, col);
+        } else if (op == UNDO_LINE_DEL && row + col <= E.line_count && col > 0) {
+            delete_lines_at(row, col);
+        } else {
+            break;
+        }
+        p += tn;
+        good = p;
+        count++;
+    }
+    s_undo.replaying = 0;
+    if (E.line_count == 0) insert_line_at(0, "", 0);
+
+    /* Keep what replayed; new records follow it */
+    int damaged = good < end;
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd >= 0) {
+        write_all(fd, data, good - data);
+        close(fd);
+    }
+    s_swap.created = 1;
+    s_swap.found = 0;
+    s_swap.armed = 1;
+
+    E.cur_row = row < E.line_count ? row : E.line_count - 1;
+    E.cur_col = 0;
+    E.modified = count > 0;
+    mark_all_dirty();
+    snprintf(E.status, sizeof(E.status), "Recovered %d changes from %.60s%s",
+             count, path, damaged ? ", rest was damaged" : "");
+    free(data);
+}
+
+/* Put the live buffer into the recovery prompt if it has a stale swap file */
+static void swap_offer(void) {
+    if (E.mode == MODE_RECOVER) E.mode = MODE_NORMAL;
+    if (!s_swap.found) return;
+    char path[sizeof(E.filepath) + 8];
+    swap_path(path, sizeof(path));
+    E.mode = MODE_RECOVER;
+    snprintf(E.status, sizeof(E.status), "Found %.80s: (r)ecover, (e)dit anyway, (d)elete it", path);
+}
+
+/* ========== Input Handling ========== */
+/*
+ * Input is read in batches: one read() takes everything pending, then keys
+ * are decoded out of s_in until it runs dry and the screen is drawn once.
+ * Only a partial escape sequence can be left over, so the buffer is
+ * compacted rather than wrapped.
+ */
+static struct {
+    unsigned char buf[IN_BUF_SIZE];
+    int pos;                /* Next byte to decode */
+    int len;                /* Bytes in buf */
+    int more;               /* Last read filled the buffer; more may be pending */
+} s_in;
+
+/* With -s, input_fill() reads from here, one frame's keys at a time */
+static struct {
+    char *keys;
+    long len;
+    long pos;               /* Next byte to hand out */
+    long frame_end;         /* End of the current frame's keys */
+} s_script;
+
+enum { DEC_ESC, DEC_CSI, DEC_CSI_REST, DEC_SS3 };
+
+/* Final byte of ESC [ x and ESC O x */
+static const unsigned short s_final_keys[128] = {
+    ['A'] = KEY_UP,   ['B'] = KEY_DOWN, ['C'] = KEY_RIGHT, ['D'] = KEY_LEFT,
+    ['H'] = KEY_HOME, ['F'] = KEY_END,
+};
+
+/* First parameter of ESC [ n ~ */
+static const unsigned short s_tilde_keys[] = {
+    [1] = KEY_HOME, [3] = KEY_DELETE, [4] = KEY_END, [5] = KEY_PAGE_UP, [6] = KEY_PAGE_DOWN,
+    [7] = KEY_HOME, [8] = KEY_END,
+};
+
+/* Single bytes outside escape sequences */
+static int decode_byte(unsigned char c) {
+    if (c == 127 || c == 8) return KEY_BACKSPACE;
+    if (c == '\r' || c == '\n') return KEY_ENTER;
+    if (c > 0 && c < 127) return c;     /* Printable and control keys */
+    if (c >= 0x80) return c;            /* UTF-8 bytes, taken as text */
+    return KEY_NONE;
+}
+
+/* Read what is pending: bytes added, 0 for none yet, -1 when the read
+ * found EOF or failed. With VMIN 0 a plain read can also find nothing,
+ * so -1 means the terminal went away only when poll said input waited. */
+static int input_fill(void) {
+    if (s_in.pos > 0) {
+        memmove(s_in.buf, s_in.buf + s_in.pos, s_in.len - s_in.pos);
+        s_in.len -= s_in.pos;
+        s_in.pos = 0;
+    }
+    int room = IN_BUF_SIZE - s_in.len;
+    int n;
+    if (s_script.keys) {
+        long left = s_script.frame_end - s_script.pos;
+        n = left < room ? (int)left : room;
+        memcpy(s_in.buf + s_in.len, s_script.keys + s_script.pos, n);
+        s_script.pos += n;
+    } else {
+        n = room > 0 ? read(STDIN_FILENO, s_in.buf + s_in.len, room) : 0;
+#ifndef __XTENSA__
+        if (room > 0 && (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))) {
+            s_in.more = 0;
+            return -1;
+        }
+#endif
+    }
+    if (n <= 0) {
+        s_in.more = 0;
+        return 0;
+    }
+    s_in.len += n;
+    s_in.more = n == room;
+    return n;
+}
+
+/*
+ * Decode the escape sequence at s_in.pos. Returns the key (KEY_NONE for
+ * unrecognized sequences) and sets *used, or returns -1 if the sequence
+ * is still incomplete.
+ */
+static int decode_escape(int *used) {
+    int state = DEC_ESC;
+    int param = 0;
+
+    for (int i = s_in.pos + 1; i < s_in.len; i++) {
+        unsigned char c = s_in.buf[i];
+        *used = i - s_in.pos + 1;
+        switch (state) {
+            case DEC_ESC:
+                if (c == '[') state = DEC_CSI;
+                else if (c == 'O') state = DEC_SS3;
+                else {
+                    *used = 1;      /* ESC followed by an ordinary key */
+                    return KEY_ESC;
                 }
+                break;
+            case DEC_CSI:
+            case DEC_CSI_REST:
+                if (c >= 0x40 && c <= 0x7E) {
+                    if (c != '~') return s_final_keys[c];
+                    if (param < (int)(sizeof(s_tilde_keys) / sizeof(s_tilde_keys[0]))) {
+                        return s_tilde_keys[param];
+                    }
+                    return KEY_NONE;
+                }
+                /* Keep the first parameter, skip modifiers after ';' */
+                if (c == ';') state = DEC_CSI_REST;
+                else if (state == DEC_CSI && c >= '0' && c <= '9') param = param * 10 + c - '0';
+                break;
+            case DEC_SS3:
+                return c < 128 ? s_final_keys[c] : KEY_NONE;
+        }
+    }
+    return -1;
+}
+
+/* Next decoded key from the buffer, or KEY_NONE once it is empty */
+static int input_next(void) {
+    while (s_in.pos < s_in.len) {
+        unsigned char c = s_in.buf[s_in.pos];
+        int key;
+
+        if (c != 27) {
+            s_in.pos++;
+            key = decode_byte(c);
+        } else {
+            int used;
+            key = decode_escape(&used);
+            if (key < 0) {
+                /* Sequence split across reads, or a lone ESC */
+                if ((s_script.keys || plat_wait_input(ESC_WAIT_MS) > 0) && input_fill() > 0) continue;
+                used = 1;
+                key = KEY_ESC;
+            }
+            s_in.pos += used;
+        }
+        if (key != KEY_NONE) return key;
+    }
+    return KEY_NONE;
+}
+
+/* Take consecutive printable bytes straight from the buffer (paste path) */
+static int input_take_text(char *dst, int max) {
+    int n = 0;
+    while (n < max && s_in.pos < s_in.len) {
+        unsigned char c = s_in.buf[s_in.pos];
+        if (c < 32 || c == 127) break;
+        dst[n++] = c;
+        s_in.pos++;
+    }
+    return n;
+}
+
+/* ========== UTF-8 Columns ========== */
+/*
+ * Cursor positions are byte offsets, but the screen counts characters, one
+ * column each (wide and combining forms are not special-cased). Each line
+ * caches in line_t.utf whether it is plain ASCII, where bytes and columns
+ * are the same. For the last multibyte line asked about, normally the
+ * cursor line, s_cmap maps both directions until an edit reaches it, so
+ * cursor moves and horizontal scrolling do not rescan the line.
+ */
+static struct {
+    int row;                /* Mapped line, -1 for none */
+    int len;                /* Its bytes */
+    int cols;               /* Its characters */
+    int *byte_col;          /* len + 1 entries: column of each byte */
+    int *col_byte;          /* cols + 1 entries: first byte of each column */
+    int cap;                /* Entries allocated in each */
+} s_cmap = { .row = -1 };
+
+/* Lines from row down changed or moved */
+static void cmap_forget(int row) {
+    if (s_cmap.row >= row) s_cmap.row = -1;
+}
+
+static int utf_plain(const char *s, int n) {
+    for (int i = 0; i < n; i++) {
+        if ((unsigned char)s[i] >= 0x80) return 0;
+    }
+    return 1;
+}
+
+/* Text of row changed: n bytes of s went in, or s is NULL for an erase */
+static void utf_changed(int row, const char *s, int n) {
+    line_t *l = &E.lines[row];
+    if (!s) {
+        if (l->utf == UTF_MULTI) l->utf = UTF_UNKNOWN;
+    } else if (l->utf == UTF_ASCII && !utf_plain(s, n)) {
+        l->utf = UTF_MULTI;
+    }
+    cmap_forget(row);
+}
+
+static int utf_ascii(int row) {
+    line_t *l = &E.lines[row];
+    if (l->utf == UTF_UNKNOWN) {
+        int plain;
+        if (!l->cap) {
+            plain = !l->len || utf_plain(src_text(l->off, l->len), l->len);
+        } else {
+            plain = utf_plain(l->buf, l->gap) &&
+                    utf_plain(l->buf + l->gap + l->cap - l->len, l->len - l->gap);
+        }
+        l->utf = plain ? UTF_ASCII : UTF_MULTI;
+    }
+    return l->utf == UTF_ASCII;
+}
+
+static int cmap_build(int row) {
+    int len = line_len(row);
+    if (len + 1 > s_cmap.cap) {
+        int cap = len + 1 + 64;
+        int *byte_col = realloc(s_cmap.byte_col, cap * sizeof(int));
+        if (byte_col) s_cmap.byte_col = byte_col;
+        int *col_byte = realloc(s_cmap.col_byte, cap * sizeof(int));
+        if (col_byte) s_cmap.col_byte = col_byte;
+        if (!byte_col || !col_byte) return 0;
+        s_cmap.cap = cap;
+    }
+
+    int cols = 0;
+    for (int i = 0; i < len; i++) {
+        if (i == 0 || !UTF_CONT(line_byte(row, i))) s_cmap.col_byte[cols++] = i;
+        s_cmap.byte_col[i] = cols - 1;
+    }
+    s_cmap.byte_col[len] = cols;
+    s_cmap.col_byte[cols] = len;
+    s_cmap.row = row;
+    s_cmap.len = len;
+    s_cmap.cols = cols;
+    return 1;
+}
+
+/* Byte offset n characters after (n > 0) or before (n < 0) col */
+static int utf_step(int row, int col, int n) {
+    int len = line_len(row);
+    for (; n > 0 && col < len; n--) {
+        col++;
+        while (col < len && UTF_CONT(line_byte(row, col))) col++;
+    }
+    for (; n < 0 && col > 0; n++) {
+        col--;
+        while (col > 0 && UTF_CONT(line_byte(row, col))) col--;
+    }
+    return col;
+}
+
+/* Screen column of byte offset col */
+static int utf_col(int row, int col) {
+    if (utf_ascii(row)) return col;
+    if (s_cmap.row == row || cmap_build(row)) {
+        return s_cmap.byte_col[col < s_cmap.len ? col : s_cmap.len];
+    }
+    int n = 0;
+    for (int i = 0; i < col; i = utf_step(row, i, 1)) n++;
+    return n;
+}
+
+/* Byte offset where screen column vcol starts, or the line length */
+static int utf_byte(int row, int vcol) {
+    int len = line_len(row);
+    if (vcol <= 0) return 0;
+    if (utf_ascii(row)) return vcol < len ? vcol : len;
+    if (s_cmap.row == row) return vcol < s_cmap.cols ? s_cmap.col_byte[vcol] : len;
+    return utf_step(row, 0, vcol);  /* Rows other than the cursor's are drawn, not walked */
+}
+
+/* Pack a character's bytes into a screen cell, '?' if it is not valid */
+static unsigned utf_cell(const char *s, int n) {
+    unsigned char c = s[0];
+    if (c < 0x80) return c;     /* Stray continuation bytes after it are dropped */
+    int want = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC2 ? 2 : 0;
+    if (want != n || c > 0xF4) return '?';
+    unsigned cell = 0;
+    for (int i = n - 1; i >= 0; i--) cell = cell << 8 | (unsigned char)s[i];
+    return cell;
+}
+
+/* Characters in a NUL-terminated string */
+static int utf_width(const char *s) {
+    int n = 0;
+    for (; *s; s++) n += !UTF_CONT(*s);
+    return n;
+}
+
+/* ========== Cursor Movement ========== */
+static void clamp_cursor(void) {
+    if (E.cur_row < 0) E.cur_row = 0;
+    if (!line_exists(E.cur_row)) E.cur_row = E.line_count - 1;
+    if (E.cur_row < 0) E.cur_row = 0;
+
+    int len = line_len(E.cur_row);
+    if (E.mode == MODE_INSERT) {
+        /* In insert mode, can be at end of line */
+        if (E.cur_col > len) E.cur_col = len;
+    } else {
+        /* In normal mode, can't be past last char */
+        if (len == 0) {
+            E.cur_col = 0;
+        } else if (E.cur_col >= len) {
+            E.cur_col = len - 1;
+        }
+    }
+    if (E.cur_col < 0) E.cur_col = 0;
+
+    /* Rest on the first byte of a character */
+    while (E.cur_col > 0 && E.cur_col < len && UTF_CONT(line_byte(E.cur_row, E.cur_col))) {
+        E.cur_col--;
+    }
+}
+
+/* Move to row, keeping the screen column */
+static void move_to_row(int row) {
+    int col = utf_col(E.cur_row, E.cur_col);
+    E.cur_row = row;
+    E.cur_col = utf_byte(row, col);
+    clamp_cursor();
+}
+
+static void move_up(void) {
+    if (E.cur_row > 0) move_to_row(E.cur_row - 1);
+}
+
+static void move_down(void) {
+    if (line_exists(E.cur_row + 1)) move_to_row(E.cur_row + 1);
+}
+
+static void move_left(void) {
+    E.cur_col = utf_step(E.cur_row, E.cur_col, -1);
+    clamp_cursor();
+}
+
+static void move_right(void) {
+    E.cur_col = utf_step(E.cur_row, E.cur_col, 1);
+    clamp_cursor();
+}
+
+/* Ctrl-F/Ctrl-B: scroll by screenfuls, keeping two lines of context */
+static void move_pages(int pages) {
+    int step = E.screen_rows - 3 > 1 ? E.screen_rows - 3 : 1;
+    int top = E.top_line + pages * step;
+    if (top < 0) top = 0;
+    if (!line_exists(top)) top = E.line_count - 1;
+    E.top_line = top;
+    E.cur_row = pages > 0 ? top : top + E.screen_rows - 2;
+    clamp_cursor();
+}
+
+/* ========== Text Editing ========== */
+static void insert_text(const char *s, int n) {
+    line_insert(E.cur_row, E.cur_col, s, n);
+    E.cur_col += n;
+    E.modified = 1;
+}
+
+
+static void delete_char_at(int col) {
+    if (col < 0 || col >= line_len(E.cur_row)) return;
+
+    line_erase(E.cur_row, col, utf_step(E.cur_row, col, 1) - col);
+    E.modified = 1;
+}
+
+static void backspace_char(void) {
+    if (E.cur_col > 0) {
+        E.cur_col = utf_step(E.cur_row, E.cur_col, -1);
+        delete_char_at(E.cur_col);
+    } else if (E.cur_row > 0) {
+        /* Join with previous line */
+        int prev_len = line_len(E.cur_row - 1);
+        line_insert(E.cur_row - 1, prev_len, line_text(E.cur_row), line_len(E.cur_row));
+
+        delete_line_at(E.cur_row);
+        E.cur_row--;
+        E.cur_col = prev_len;
+        E.modified = 1;
+    }
+}
+
+static void insert_newline(void) {
+    int len = line_len(E.cur_row);
+    const char *text = line_text(E.cur_row);
+
+    insert_line_at(E.cur_row + 1, text + E.cur_col, len - E.cur_col);
+    line_truncate(E.cur_row, E.cur_col);
+
+    E.cur_row++;
+    E.cur_col = 0;
+    E.modified = 1;
+}
+
+/* ========== Registers ========== */
+/*
+ * Yanked and deleted text. Slot 0 is the unnamed register that every yank
+ * and delete fills; slots 1..26 are "a to "z. Linewise text holds its
+ * lines joined with '\n', the same shape insert_lines_at() takes, so a
+ * put of any size is one bulk insert.
+ */
+#define REG_COUNT       27
+
+typedef struct {
+    char *text;
+    int len;
+    int lines;              /* Line count if linewise, 0 if characterwise */
+} reg_t;
+
+static reg_t s_regs[REG_COUNT];
+
+static int reg_index(int name) {
+    return name >= 'a' && name <= 'z' ? name - 'a' + 1 : 0;
+}
+
+static void reg_set(reg_t *r, char *text, int len, int lines) {
+    free(r->text);
+    r->text = text;
+    r->len = len;
+    r->lines = lines;
+}
+
+/* Takes ownership of text */
+static void reg_store(int name, char *text, int len, int lines) {
+    int i = reg_index(name);
+    if (i) {
+        char *copy = malloc(len + 1);
+        if (copy) {
+            memcpy(copy, text, len);
+            reg_set(&s_regs[i], copy, len, lines);
+        }
+    }
+    reg_set(&s_regs[0], text, len, lines);
+}
+
+static void regs_free(void) {
+    for (int i = 0; i < REG_COUNT; i++) reg_set(&s_regs[i], NULL, 0, 0);
+}
+
+static void yank_lines(int name, int row, int n) {
+    if (n <= 0) return;
+    long len = lines_size(row, n);
+    char *text = malloc(len + 1);
+    if (!text) return;
+    lines_copy_out(row, n, text);
+    reg_store(name, text, len, n);
+}
+
+static void yank_chars(int name, int row, int col, int n) {
+    char *text = malloc(n + 1);
+    if (!text) return;
+    line_copy(row, col, n, text);
+    reg_store(name, text, n, 0);
+}
+
+static void put_register(int name, int after, int count) {
+    const reg_t *r = &s_regs[reg_index(name)];
+    if (!r->text) {
+        snprintf(E.status, sizeof(E.status), "Nothing in register %c", name ? name : '"');
+        return;
+    }
+
+    if (r->lines) {
+        /* count copies go in as one block */
+        const char *text = r->text;
+        long len = r->len;
+        char *copies = NULL;
+        if (count > 1) {
+            len = ((long)r->len + 1) * count - 1;
+            copies = malloc(len + 1);
+            if (!copies) return;
+            for (int i = 0; i < count; i++) {
+                memcpy(copies + (long)i * (r->len + 1), r->text, r->len);
+                if (i < count - 1) copies[(long)i * (r->len + 1) + r->len] = '\n';
+            }
+            text = copies;
+        }
+        int row = after ? E.cur_row + 1 : E.cur_row;
+        insert_lines_at(row, text, len, r->lines * count);
+        free(copies);
+        E.cur_row = row;
+        E.cur_col = 0;
+    } else {
+        int col = after ? utf_step(E.cur_row, E.cur_col, 1) : E.cur_col;
+        for (int i = 0; i < count; i++) line_insert(E.cur_row, col, r->text, r->len);
+        E.cur_col = col + r->len * count - 1;
+    }
+    E.modified = 1;
+    clamp_cursor();
+}
+
+/* ========== Motions and Operators ========== */
+/*
+ * Normal-mode commands are [count]["x][count]operator motion, or a motion
+ * or command on its own. Keys arrive one at a time, so s_cmd carries the
+ * partial command between them.
+ */
+static struct {
+    int count;              /* Count being typed, 0 for none */
+    int op;                 /* Pending operator 'd', 'c', 'y', or 0 */
+    int op_count;           /* Count typed before the operator */
+    int reg;                /* Register named with ", or 0 */
+    int prefix;             /* '"' or 'g' waiting for its second key */
+} s_cmd;
+
+/* Blank, word character, or other punctuation */
+static int char_class(int c) {
+    if (c == ' ' || c == '\t') return 0;
+    if (isalnum(c) || c == '_' || c >= 0x80) return 1;  /* UTF-8 letters count as word */
+    return 2;
+}
+
+static int first_nonblank(int row) {
+    const char *t = line_text(row);
+    int len = line_len(row), c = 0;
+    while (c < len && (t[c] == ' ' || t[c] == '\t')) c++;
+    return c < len ? c : 0;
+}
+
+/* w: start of the next word; an empty line counts as one */
+static void word_forward(int *row, int *col) {
+    int r = *row, c = *col;
+    const char *t = line_text(r);
+    int len = line_len(r);
+
+    if (c < len && char_class((unsigned char)t[c])) {
+        int cls = char_class((unsigned char)t[c]);
+        while (c < len && char_class((unsigned char)t[c]) == cls) c++;
+    }
+    for (;;) {
+        while (c < len && !char_class((unsigned char)t[c])) c++;
+        if (c < len || !line_exists(r + 1)) break;
+        r++;
+        c = 0;
+        t = line_text(r);
+        len = line_len(r);
+        if (len == 0) break;
+    }
+    *row = r;
+    *col = c;
+}
+
+/* b: start of the previous word */
+static void word_backward(int *row, int *col) {
+    int r = *row, c = *col - 1;
+    const char *t = line_text(r);
+
+    for (;;) {
+        if (c < 0) {
+            if (r == 0) {
+                *row = 0;
+                *col = 0;
+                return;
+            }
+            r--;
+            t = line_text(r);
+            c = line_len(r) - 1;
+            if (c < 0) break;           /* Empty line */
+        } else if (char_class((unsigned char)t[c])) {
+            int cls = char_class((unsigned char)t[c]);
+            while (c > 0 && char_class((unsigned char)t[c - 1]) == cls) c--;
+            break;
+        } else {
+            c--;
+        }
+    }
+    *row = r;
+    *col = c < 0 ? 0 : c;
+}
+
+/* e: last character of the current or next word */
+static void word_end(int *row, int *col) {
+    int r = *row, c = *col + 1;
+    const char *t = line_text(r);
+    int len = line_len(r);
+
+    for (;;) {
+        if (c >= len) {
+            if (!line_exists(r + 1)) {
+                c = len ? len - 1 : 0;
+                break;
+            }
+            r++;
+            c = 0;
+            t = line_text(r);
+            len = line_len(r);
+        } else if (char_class((unsigned char)t[c])) {
+            int cls = char_class((unsigned char)t[c]);
+            while (c + 1 < len && char_class((unsigned char)t[c + 1]) == cls) c++;
+            break;
+        } else {
+            c++;
+        }
+    }
+    *row = r;
+    *col = c;
+}
+
+/*
+ * Where motion key takes the cursor, repeated n times. Returns 0 if key
+ * is not a motion. *linewise: an operator takes whole lines; *inclusive:
+ * it takes the character at the target too. G and gg read a typed count
+ * as a line number.
+ */
+static int motion_target(int key, int n, int has_count, int *row, int *col,
+                         int *linewise, int *inclusive) {
+    *linewise = 0;
+    *inclusive = 0;
+    switch (key) {
+        case 'h':
+        case KEY_LEFT:
+        case KEY_BACKSPACE:
+            *col = utf_step(*row, *col, -n);
+            break;
+        case 'l':
+        case ' ':
+        case KEY_RIGHT:
+            *col = utf_step(*row, *col, n);
+            break;
+        case 'j':
+        case KEY_DOWN:
+        case 'k':
+        case KEY_UP: {
+            /* Same screen column on the new line */
+            int vcol = utf_col(*row, *col);
+            if (key == 'j' || key == KEY_DOWN) {
+                while (n-- > 0 && line_exists(*row + 1)) (*row)++;
+            } else {
+                *row = *row > n ? *row - n : 0;
+            }
+            *col = utf_byte(*row, vcol);
+            *linewise = 1;
+            break;
+        }
+        case '0':
+        case KEY_HOME:
+            *col = 0;
+            break;
+        case '^':
+            *col = first_nonblank(*row);
+            break;
+        case '$':
+        case KEY_END:
+            while (--n > 0 && line_exists(*row + 1)) (*row)++;
+            *col = line_len(*row);
+            break;
+        case 'w':
+            while (n-- > 0) word_forward(row, col);
+            break;
+        case 'b':
+            while (n-- > 0) word_backward(row, col);
+            break;
+        case 'e':
+            while (n-- > 0) word_end(row, col);
+            *inclusive = 1;
+            break;
+        case 'G':
+        case 'g':               /* gg */
+            if (has_count) {
+                *row = n - 1;
+                if (!line_exists(*row)) *row = E.line_count - 1;
+            } else if (key == 'G') {
+                index_all();
+                *row = E.line_count - 1;
+            } else {
+                *row = 0;
+            }
+            *col = first_nonblank(*row);
+            *linewise = 1;
+            break;
+        default:
+            return 0;
+    }
+    return 1;
+}
+
+/* Apply op to n lines from row */
+static void operate_lines(int op, int reg, int row, int n) {
+    line_exists(row + n - 1);
+    if (n > E.line_count - row) n = E.line_count - row;
+    if (n <= 0) return;
+    yank_lines(reg, row, n);
+
+    if (op == 'y') {
+        E.cur_row = row;
+        if (n > 2) snprintf(E.status, sizeof(E.status), "%d lines yanked", n);
+        return;
+    }
+    if (op == 'c') {
+        /* Keep one line to type into */
+        delete_lines_at(row + 1, n - 1);
+        line_truncate(row, 0);
+        E.cur_row = row;
+        E.cur_col = 0;
+        E.mode = MODE_INSERT;
+    } else {
+        delete_lines_at(row, n);
+        E.cur_row = row;
+        clamp_cursor();
+        E.cur_col = first_nonblank(E.cur_row);
+        if (n > 2) snprintf(E.status, sizeof(E.status), "%d fewer lines", n);
+    }
+    E.modified = 1;
+}
+
+/* Apply op from the cursor to a motion target */
+static void operate(int op, int reg, int row, int col, int linewise, int inclusive) {
+    if (linewise) {
+        int top = row < E.cur_row ? row : E.cur_row;
+        int bottom = row < E.cur_row ? E.cur_row : row;
+        operate_lines(op, reg, top, bottom - top + 1);
+        return;
+    }
+
+    /* Characterwise operators stay on the cursor line */
+    int len = line_len(E.cur_row);
+    if (row > E.cur_row) {
+        col = len;
+        inclusive = 0;
+    } else if (row < E.cur_row) {
+        col = 0;
+    }
+    int from = col < E.cur_col ? col : E.cur_col;
+    int to = col < E.cur_col ? E.cur_col : col;
+    if (inclusive) to++;
+    if (to > len) to = len;
+
+    if (to > from) yank_chars(reg, E.cur_row, from, to - from);
+    E.cur_col = from;
+    if (op != 'y' && to > from) {
+        line_erase(E.cur_row, from, to - from);
+        E.modified = 1;
+    }
+    if (op == 'c') E.mode = MODE_INSERT;
+    clamp_cursor();
+}
+
+/* ========== Undo / Redo ========== */
+static void undo_apply(const undo_rec_t *r, int reverse) {
+    const char *text = (const char *)(r + 1);
+    int op = r->op & UNDO_OP_MASK;
+    if (reverse) {
+        /* Swap each operation for its inverse */
+        static const int inverse[] = { UNDO_ERASE, UNDO_INSERT, UNDO_LINE_DEL, UNDO_LINE_ADD };
+        op = inverse[op];
+    }
+    switch (op) {
+        case UNDO_INSERT:   line_insert(r->row, r->col, text, r->len); break;
+        case UNDO_ERASE:    line_erase(r->row, r->col, r->len); break;
+        case UNDO_LINE_ADD: insert_lines_at(r->row, text, r->len, r->col); break;
+        case UNDO_LINE_DEL: delete_lines_at(r->row, r->col); break;
+    }
+    E.cur_row = r->row;
+    E.cur_col = op == UNDO_INSERT || op == UNDO_ERASE ? r->col : 0;
+}
+
+static void undo(void) {
+    if (s_undo.cur == 0) {
+        snprintf(E.status, sizeof(E.status), s_undo.lost ?
+                 "Change too large to undo" : "Already at oldest change");
+        return;
+    }
+    s_undo.replaying = 1;
+    const undo_rec_t *r;
+    do {
+        int size;
+        memcpy(&size, s_undo.arena + s_undo.cur - sizeof(int), sizeof(int));
+        s_undo.cur -= size;
+        r = undo_at(s_undo.cur);
+        undo_apply(r, 1);
+    } while (!(r->op & UNDO_GROUP));
+    s_undo.replaying = 0;
+    s_undo.last = -1;
+    undo_boundary();
+    E.modified = s_undo.cur != s_undo.saved;
+    clamp_cursor();
+}
+
+static void redo(void) {
+    if (s_undo.cur == s_undo.top) {
+        snprintf(E.status, sizeof(E.status), "Already at newest change");
+        return;
+    }
+    s_undo.replaying = 1;
+    do {
+        const undo_rec_t *r = undo_at(s_undo.cur);
+        undo_apply(r, 0);
+        s_undo.cur += undo_rec_size(r->len);
+    } while (s_undo.cur < s_undo.top && !(undo_at(s_undo.cur)->op & UNDO_GROUP));
+    s_undo.replaying = 0;
+    s_undo.last = -1;
+    undo_boundary();
+    E.modified = s_undo.cur != s_undo.saved;
+    clamp_cursor();
+}
+
+/* ========== Search ========== */
+static char s_search_prev[CMD_BUF_SIZE];   /* Pattern before the current / or ? */
+static int s_search_prev_hl;
+
+/*
+ * Find the next match from (row, col) going dir, wrapping around the file
+ * once. Forward matches start at or after col, backward ones before it.
+ * Scans at most max_lines lines when nonzero. Returns 0 if not found,
+ * 1 if found, 2 if found after wrapping.
+ */
+static int search_from(int row, int col, int dir, int max_lines, int *out_row, int *out_col) {
+    int start = row;
+    int wrapped = 0;
+    if (!s_pat.len) return 0;
+
+    for (int scanned = 0; !max_lines || scanned < max_lines; scanned++) {
+        const char *text = line_text(row);
+        int len = line_len(row);
+        int hit = dir > 0 ? pat_find(text, len, col) : pat_find_last(text, len, col);
+        if (hit >= 0) {
+            *out_row = row;
+            *out_col = hit;
+            return wrapped ? 2 : 1;
+        }
+        if (wrapped && row == start) break;
+
+        row += dir;
+        if (dir > 0 && !line_exists(row)) {
+            row = 0;
+            wrapped = 1;
+        } else if (dir < 0 && row < 0) {
+            index_all();
+            row = E.line_count - 1;
+            wrapped = 1;
+        }
+        col = dir > 0 ? 0 : line_len(row) + 1;
+    }
+    return 0;
+}
+
+static void search_show(int on) {
+    if (E.search_hl != on) mark_all_dirty();
+    E.search_hl = on;
+}
+
+/* n / N: repeat the last search, dir relative to its direction */
+static void search_next(int dir) {
+    if (!s_pat.len) {
+        snprintf(E.status, sizeof(E.status), "No previous search pattern");
+        return;
+    }
+    dir *= E.search_dir;
+
+    int row, col;
+    int found = search_from(E.cur_row, dir > 0 ? E.cur_col + 1 : E.cur_col, dir, 0, &row, &col);
+    if (!found) {
+        snprintf(E.status, sizeof(E.status), "Pattern not found: %.100s", s_pat.text);
+        return;
+    }
+    if (found == 2) {
+        snprintf(E.status, sizeof(E.status), dir > 0 ?
+                 "search hit BOTTOM, continuing at TOP" :
+                 "search hit TOP, continuing at BOTTOM");
+    }
+    E.cur_row = row;
+    E.cur_col = col;
+    search_show(1);
+}
+
+static void search_start(int dir) {
+    memcpy(s_search_prev, s_pat.text, sizeof(s_search_prev));
+    s_search_prev_hl = E.search_hl;
+    E.mode = MODE_SEARCH;
+    E.search_dir = dir;
+    E.search_row = E.cur_row;
+    E.search_col = E.cur_col;
+    E.cmd_buf[0] = '\0';
+    E.cmd_len = 0;
+}
+
+/* Jump to the first match of the pattern typed so far, bounded per key */
+static void search_incremental(void) {
+    E.cur_row = E.search_row;
+    E.cur_col = E.search_col;
+    pat_compile(E.cmd_buf);
+    search_show(1);
+    mark_all_dirty();
+
+    int row, col;
+    int from = E.search_dir > 0 ? E.cur_col + 1 : E.cur_col;
+    if (search_from(E.cur_row, from, E.search_dir, INCSEARCH_LINES, &row, &col)) {
+        E.cur_row = row;
+        E.cur_col = col;
+    }
+}
+
+static void search_cancel(void) {
+    E.cur_row = E.search_row;
+    E.cur_col = E.search_col;
+    pat_compile(s_search_prev);
+    search_show(s_search_prev_hl);
+    mark_all_dirty();
+    E.mode = MODE_NORMAL;
+}
+
+static void search_accept(void) {
+    E.mode = MODE_NORMAL;
+    E.cur_row = E.search_row;
+    E.cur_col = E.search_col;
+    /* An empty pattern repeats the previous one */
+    pat_compile(E.cmd_len ? E.cmd_buf : s_search_prev);
+    search_next(1);
+}
+
+/* ========== Syntax Highlighting ========== */
+/*
+ * Lexing is line-at-a-time with a small carried state (open block comment
+ * or quote). Each line caches the state at its end in line_t.hl, and
+ * E.hl_valid counts the leading lines whose cache is current. Edits pull
+ * the watermark back to the edited line. Re-lexing forward stops paying
+ * as soon as a line ends in the state it had cached: lines after it were
+ * lexed from that same state, so their caches hold up to the next line
+ * whose own text changed (HL_DIRTY).
+ */
+static const char *const s_c_keywords[] = {
+    "if", "else", "for", "while", "do", "switch", "case", "default", "break",
+    "continue", "return", "goto", "sizeof", "typedef", "struct", "union", "enum",
+    "static", "extern", "const", "volatile", "inline", "register", "restrict", NULL
+};
+
+static const char *const s_c_types[] = {
+    "int", "char", "short", "long", "unsigned", "signed", "float", "double",
+    "void", "bool", "size_t", "ssize_t", "int8_t", "int16_t", "int32_t", "int64_t",
+    "uint8_t", "uint16_t", "uint32_t", "uint64_t", "FILE", NULL
+};
+
+static const char *const s_sh_keywords[] = {
+    "if", "then", "else", "elif", "fi", "for", "in", "do", "done", "while",
+    "until", "case", "esac", "function", "return", "exit", "local", "export",
+    "break", "continue", NULL
+};
+
+static const char *const s_make_keywords[] = {
+    "include", "-include", "ifeq", "ifneq", "ifdef", "ifndef", "else", "endif",
+    "define", "endef", "export", "override", NULL
+};
+
+static int hl_word_in(const char *const *list, const char *s, int n) {
+    for (; *list; list++) {
+        if ((*list)[0] == s[0] && (int)strlen(*list) == n && memcmp(*list, s, n) == 0) return 1;
+    }
+    return 0;
+}
+
+static int hl_ident(int c) {
+    return isalnum(c) || c == '_';
+}
+
+/* Colour text columns [a, b) where they fall inside the rendered window */
+static unsigned char *s_hl_attr;
+static int s_hl_from, s_hl_width;
+
+static void hl_paint(int a, int b, int attr) {
+    if (!s_hl_attr) return;
+    if (a < s_hl_from) a = s_hl_from;
+    if (b > s_hl_from + s_hl_width) b = s_hl_from + s_hl_width;
+    for (int i = a; i < b; i++) s_hl_attr[i - s_hl_from] = attr;
+}
+
+/* Offset just past the quote closing at or after i, or -1 if unterminated */
+static int hl_quote_end(const char *s, int n, int i, char q, int escapes) {
+    for (; i < n; i++) {
+        if (escapes && s[i] == '\\') i++;
+        else if (s[i] == q) return i + 1;
+    }
+    return -1;
+}
+
+static int hl_lex_c(const char *s, int n, int state) {
+    int i = 0;
+
+    if (state == HL_COMMENT) {
+        for (; i + 1 < n && !(s[i] == '*' && s[i + 1] == '/'); i++) {}
+        if (i + 1 >= n) {
+            hl_paint(0, n, ATTR_COMMENT);
+            return HL_COMMENT;
+        }
+        i += 2;
+        hl_paint(0, i, ATTR_COMMENT);
+    }
+
+    /* Preprocessor directive name */
+    int k = i;
+    while (k < n && (s[k] == ' ' || s[k] == '\t')) k++;
+    if (k < n && s[k] == '#' && i == 0) {
+        int e = k + 1;
+        while (e < n && (s[e] == ' ' || s[e] == '\t')) e++;
+        while (e < n && hl_ident((unsigned char)s[e])) e++;
+        hl_paint(k, e, ATTR_PREPROC);
+        i = e;
+    }
+
+    while (i < n) {
+        unsigned char c = s[i];
+        if (c == '/' && i + 1 < n && s[i + 1] == '/') {
+            hl_paint(i, n, ATTR_COMMENT);
+            return HL_NORMAL;
+        }
+        if (c == '/' && i + 1 < n && s[i + 1] == '*') {
+            int e = i + 2;
+            for (; e + 1 < n && !(s[e] == '*' && s[e + 1] == '/'); e++) {}
+            if (e + 1 >= n) {
+                hl_paint(i, n, ATTR_COMMENT);
+                return HL_COMMENT;
+            }
+            hl_paint(i, e + 2, ATTR_COMMENT);
+            i = e + 2;
+        } else if (c == '"' || c == '\'') {
+            int e = hl_quote_end(s, n, i + 1, c, 1);
+            if (e < 0) e = n;
+            hl_paint(i, e, ATTR_STRING);
+            i = e;
+        } else if (isdigit(c)) {
+            int e = i + 1;
+            while (e < n && (hl_ident((unsigned char)s[e]) || s[e] == '.')) e++;
+            hl_paint(i, e, ATTR_NUMBER);
+            i = e;
+        } else if (hl_ident(c)) {
+            int e = i + 1;
+            while (e < n && hl_ident((unsigned char)s[e])) e++;
+            if (hl_word_in(s_c_keywords, s + i, e - i)) hl_paint(i, e, ATTR_KEYWORD);
+            else if (hl_word_in(s_c_types, s + i, e - i)) hl_paint(i, e, ATTR_TYPE);
+            i = e;
+        } else {
+            i++;
+        }
+    }
+    return HL_NORMAL;
+}
+
+/* $name, ${...}, $(...) or a special parameter like $? at i; returns its end */
+static int hl_var_end(const char *s, int n, int i) {
+    if (i + 1 >= n) return i + 1;
+    char open = s[i + 1];
+    if (open == '{' || open == '(') {
+        char close = open == '{' ? '}' : ')';
+        int depth = 0;
+        for (int e = i + 1; e < n; e++) {
+            if (s[e] == open) depth++;
+            else if (s[e] == close && --depth == 0) return e + 1;
+        }
+        return n;
+    }
+    int e = i + 1;
+    if (!hl_ident((unsigned char)s[e])) return e + 1;
+    while (e < n && hl_ident((unsigned char)s[e])) e++;
+    return e;
+}
+
+static int hl_lex_sh(const char *s, int n, int state) {
+    int i = 0;
+
+    if (state == HL_SQUOTE || state == HL_DQUOTE) {
+        i = hl_quote_end(s, n, 0, state == HL_SQUOTE ? '\'' : '"', state == HL_DQUOTE);
+        if (i < 0) {
+            hl_paint(0, n, ATTR_STRING);
+            return state;
+        }
+        hl_paint(0, i, ATTR_STRING);
+    }
+
+    while (i < n) {
+        unsigned char c = s[i];
+        int word_start = i == 0 || strchr(" \t;|&(", s[i - 1]) != NULL;
+        if (c == '\\') {
+            i += 2;
+        } else if (c == '#' && word_start) {
+            hl_paint(i, n, ATTR_COMMENT);
+            break;
+        } else if (c == '\'' || c == '"') {
+            int e = hl_quote_end(s, n, i + 1, c, c == '"');
+            if (e < 0) {
+                hl_paint(i, n, ATTR_STRING);
+                return c == '\'' ? HL_SQUOTE : HL_DQUOTE;
+            }
+            hl_paint(i, e, ATTR_STRING);
+            i = e;
+        } else if (c == '$') {
+            int e = hl_var_end(s, n, i);
+            hl_paint(i, e, ATTR_PREPROC);
+            i = e;
+        } else if (hl_ident(c)) {
+            int e = i + 1;
+            while (e < n && hl_ident((unsigned char)s[e])) e++;
+            if (word_start && (e == n || strchr(" \t;|&)", s[e])) &&
+                hl_word_in(s_sh_keywords, s + i, e - i)) {
+                hl_paint(i, e, ATTR_KEYWORD);
+            } else if (isdigit(c)) {
+                hl_paint(i, e, ATTR_NUMBER);
             }
+            i = e;
+        } else {
+            i++;
+        }
+    }
+    return HL_NORMAL;
+}
+
+static int hl_lex_make(const char *s, int n) {
+    /* Recipe lines are shell commands */
+    if (n > 0 && s[0] == '\t') {
+        hl_lex_sh(s, n, HL_NORMAL);
+        return HL_NORMAL;
+    }
+
+    /* Leading word: directive, or a target when a rule colon follows */
+    int i = 0;
+    while (i < n && (s[i] == ' ' || s[i] == '\t')) i++;
+    int e = i;
+    while (e < n && (hl_ident((unsigned char)s[e]) || strchr("-./%", s[e]))) e++;
+    if (e > i && hl_word_in(s_make_keywords, s + i, e - i)) {
+        hl_paint(i, e, ATTR_KEYWORD);
+    } else {
+        int colon = e;
+        while (colon < n && s[colon] != ':' && s[colon] != '=' && s[colon] != '#') colon++;
+        if (colon < n && s[colon] == ':' && (colon + 1 >= n || s[colon + 1] != '=')) {
+            hl_paint(i, colon, ATTR_TYPE);
+        }
+    }
+
+    for (i = e; i < n; ) {
+        if (s[i] == '\\') {
+            i += 2;
+        } else if (s[i] == '#') {
+            hl_paint(i, n, ATTR_COMMENT);
+            break;
+        } else if (s[i] == '$') {
+            int v = hl_var_end(s, n, i);
+            hl_paint(i, v, ATTR_PREPROC);
+            i = v;
         } else {
-            /* Empty row - show tilde like vi */
-            out_char('~');
-            for (int i = 1; i < text_cols; i++) {
-                out_char(' ');
+            i++;
+        }
+    }
+    return HL_NORMAL;
+}
+
+/*
+ * Lex one line starting in state; returns the state at its end. With attr
+ * set, also colours text columns [from, from + width) into it.
+ */
+static int hl_lex(const char *s, int n, int state, unsigned char *attr, int from, int width) {
+    s_hl_attr = attr;
+    s_hl_from = from;
+    s_hl_width = width;
+    switch (E.syntax) {
+        case SYN_C:    return hl_lex_c(s, n, state);
+        case SYN_SH:   return hl_lex_sh(s, n, state);
+        case SYN_MAKE: return hl_lex_make(s, n);
+    }
+    return HL_NORMAL;
+}
+
+/* Bring cached states up to date for lines [0, row) */
+static void hl_sync(int row) {
+    if (row > E.line_count) row = E.line_count;
+    while (E.hl_valid < row) {
+        int k = E.hl_valid;
+        line_t *l = &E.lines[k];
+        int start = k ? E.lines[k - 1].hl & HL_STATE : HL_NORMAL;
+        int end = hl_lex(line_peek(k), line_len(k), start, NULL, 0, 0);
+        int cached = l->hl;
+        l->hl = end;
+        E.hl_valid++;
+        if (end != cached) {
+            mark_line_dirty(k + 1);     /* Next line starts differently */
+            continue;
+        }
+        /* Converged: untouched lines below still hold */
+        while (E.hl_valid < row && !(E.lines[E.hl_valid].hl & HL_DIRTY)) E.hl_valid++;
+    }
+}
+
+/* Language from the file name, or a shell shebang on the first line */
+static int hl_detect(const char *path) {
+    const char *base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+    const char *ext = strrchr(base, '.');
+
+    if (strcmp(base, "Makefile") == 0 || strcmp(base, "makefile") == 0 ||
+        strcmp(base, "GNUmakefile") == 0 || (ext && strcmp(ext, ".mk") == 0)) {
+        return SYN_MAKE;
+    }
+    if (ext && (strcmp(ext, ".c") == 0 || strcmp(ext, ".h") == 0 ||
+                strcmp(ext, ".cc") == 0 || strcmp(ext, ".cpp") == 0 ||
+                strcmp(ext, ".hpp") == 0)) {
+        return SYN_C;
+    }
+    if (ext && (strcmp(ext, ".sh") == 0 || strcmp(ext, ".bash") == 0)) return SYN_SH;
+
+    /* #!/bin/sh, #!/usr/bin/env bash, ...: interpreter name ends in "sh" */
+    if (E.line_count > 0 && line_len(0) > 2 && memcmp(line_text(0), "#!", 2) == 0) {
+        const char *t = line_text(0);
+        int n = line_len(0);
+        int i = 2, name = 2, end = 2;
+        for (int word = 0; word < 2; word++) {
+            while (i < n && t[i] == ' ') i++;
+            name = i;
+            while (i < n && t[i] != ' ') {
+                if (t[i] == '/') name = i + 1;
+                i++;
             }
+            end = i;
+            if (end - name != 3 || memcmp(t + name, "env", 3) != 0) break;
+        }
+        if (end - name >= 2 && memcmp(t + end - 2, "sh", 2) == 0) return SYN_SH;
+    }
+    return SYN_NONE;
+}
+
+/* ========== Buffers ========== */
+/*
+ * Every open file is a buffer. The active one lives in E, s_src and s_undo,
+ * where all the editing code expects it; the others are stashed by value
+ * in s_bufs. Switching is a few struct copies and a repaint: line arrays,
+ * sources and undo journals stay where they are.
+ */
+typedef struct {
+    line_t *lines;
+    int line_count;
+    int lines_alloc;
+    int cur_row, cur_col;
+    int top_line, left_col;
+    int modified;
+    int syntax;
+    int hl_valid;
+    char filepath[sizeof(E.filepath)];
+    src_t src;
+    undo_t undo;
+    swap_t swap;
+} buffer_t;
+
+static buffer_t *s_bufs;        /* Slot s_buf_cur is stale while it is live */
+static int s_buf_count;
+static int s_buf_cur;
+
+static void buf_stash(buffer_t *b) {
+    swap_flush();   /* Pending records belong to the live buffer */
+    b->lines = E.lines;
+    b->line_count = E.line_count;
+    b->lines_alloc = E.lines_alloc;
+    b->cur_row = E.cur_row;
+    b->cur_col = E.cur_col;
+    b->top_line = E.top_line;
+    b->left_col = E.left_col;
+    b->modified = E.modified;
+    b->syntax = E.syntax;
+    b->hl_valid = E.hl_valid;
+    memcpy(b->filepath, E.filepath, sizeof(b->filepath));
+    b->src = s_src;
+    b->undo = s_undo;
+    b->swap = s_swap;
+}
+
+static void buf_unstash(const buffer_t *b) {
+    E.lines = b->lines;
+    E.line_count = b->line_count;
+    E.lines_alloc = b->lines_alloc;
+    E.cur_row = b->cur_row;
+    E.cur_col = b->cur_col;
+    E.top_line = b->top_line;
+    E.left_col = b->left_col;
+    E.modified = b->modified;
+    E.syntax = b->syntax;
+    E.hl_valid = b->hl_valid;
+    memcpy(E.filepath, b->filepath, sizeof(E.filepath));
+    s_src = b->src;
+    s_undo = b->undo;
+    s_swap = b->swap;
+    cmap_forget(0);
+}
+
+/* Load path, or an empty buffer, into the live state */
+static void buf_load(const char *path) {
+    E.lines = NULL;
+    E.line_count = E.lines_alloc = 0;
+    E.cur_row = E.cur_col = E.top_line = E.left_col = 0;
+    E.modified = 0;
+    E.hl_valid = 0;
+    E.filepath[0] = '\0';
+    memset(&s_src, 0, sizeof(s_src));
+    s_src.fd = -1;
+    memset(&s_undo, 0, sizeof(s_undo));
+    memset(&s_swap, 0, sizeof(s_swap));
+    cmap_forget(0);
+
+    if (path) {
+        strncpy(E.filepath, path, sizeof(E.filepath) - 1);
+        load_file(path);
+        E.syntax = hl_detect(path);
+        swap_probe();
+    } else {
+        insert_line_at(0, "", 0);
+        E.syntax = SYN_NONE;
+        snprintf(E.status, sizeof(E.status), "[No Name]");
+    }
+    undo_reset();   /* Loading is not an undoable change */
+    mark_all_dirty();
+}
+
+static const char *buf_name(int i) {
+    const char *path = i == s_buf_cur ? E.filepath : s_bufs[i].filepath;
+    return path[0] ? path : "[No Name]";
+}
+
+static void buf_switch(int i) {
+    if (i != s_buf_cur) {
+        buf_stash(&s_bufs[s_buf_cur]);
+        buf_unstash(&s_bufs[i]);
+        s_buf_cur = i;
+        mark_all_dirty();
+    }
+    snprintf(E.status, sizeof(E.status), "[%d/%d] \"%.80s\"%s",
+             i + 1, s_buf_count, buf_name(i), E.modified ? " [+]" : "");
+    swap_offer();
+}
+
+/* Open path in a new buffer, or switch to it if it is already open */
+static void buf_edit(const char *path) {
+    for (int i = 0; path && i < s_buf_count; i++) {
+        if (strcmp(buf_name(i), path) == 0) {
+            buf_switch(i);
+            return;
+        }
+    }
+
+    buffer_t *bufs = realloc(s_bufs, (s_buf_count + 1) * sizeof(buffer_t));
+    if (!bufs) {
+        snprintf(E.status, sizeof(E.status), "Out of memory");
+        return;
+    }
+    s_bufs = bufs;
+    if (s_buf_count > 0) buf_stash(&s_bufs[s_buf_cur]);
+    s_buf_cur = s_buf_count++;
+    buf_load(path);
+    swap_offer();
+}
+
+/* First buffer other than the live one with unsaved changes, or -1 */
+static int buf_find_modified(void) {
+    for (int i = 0; i < s_buf_count; i++) {
+        if (i != s_buf_cur && s_bufs[i].modified) return i;
+    }
+    return -1;
+}
+
+/* On a deliberate quit the swap files go; when the terminal went away,
+ * modified buffers keep theirs (stashing flushed the pending records) */
+static void buf_close_all(int keep_swap) {
+    if (s_buf_count > 0) buf_stash(&s_bufs[s_buf_cur]);
+    for (int i = 0; i < s_buf_count; i++) {
+        buf_unstash(&s_bufs[i]);
+        if (keep_swap && E.modified) swap_flush();
+        else swap_discard();
+        free_all_lines();
+        src_close();
+        free(s_undo.arena);
+        s_undo.arena = NULL;
+    }
+    free(s_bufs);
+    s_bufs = NULL;
+    s_buf_count = 0;
+    pool_release();
+}
+
+/* ========== Screen Rendering ========== */
+static void adjust_viewport(void) {
+    int text_rows = E.screen_rows - 1;  /* Reserve 1 for status */
+    int text_cols = E.screen_cols;
+
+    /* Vertical scroll */
+    if (E.cur_row < E.top_line) {
+        E.top_line = E.cur_row;
+    }
+    if (E.cur_row >= E.top_line + text_rows) {
+        E.top_line = E.cur_row - text_rows + 1;
+    }
+
+    /* Horizontal scroll, in screen columns */
+    int col = utf_col(E.cur_row, E.cur_col);
+    if (col < E.left_col) {
+        E.left_col = col;
+    }
+    if (col >= E.left_col + text_cols) {
+        E.left_col = col - text_cols + 1;
+    }
+}
+
+/* Emit the changed span of s_row_buf/s_row_attr against shadow row y */
+static void flush_row(int y, int width) {
+    unsigned *old = &s_shadow[y * E.screen_cols];
+    unsigned char *old_attr = &s_shadow_attr[y * E.screen_cols];
+    const unsigned *cur = s_row_buf;
+    const unsigned char *cur_attr = s_row_attr;
+
+    int first = 0;
+    while (first < width && old[first] == cur[first] && old_attr[first] == cur_attr[first]) {
+        first++;
+    }
+    if (first == width) return;
+    int last = width - 1;
+    while (old[last] == cur[last] && old_attr[last] == cur_attr[last]) last--;
+
+    if (!s_cursor_hidden) {
+        out_str(ESC_CURSOR_HIDE);
+        s_cursor_hidden = 1;
+    }
+    out_goto(y, first);
+
+    /* Trailing plain blanks are cheaper as EL than as padding */
+    int end = last + 1;
+    while (end > first && cur[end - 1] == ' ' && cur_attr[end - 1] == ATTR_NONE) end--;
+    int use_el = last + 1 - end > (int)sizeof(ESC_EL) - 1;
+    if (!use_el) end = last + 1;
+
+    /* Runs of one attribute; rows start and end in ATTR_NONE */
+    int attr = ATTR_NONE;
+    for (int i = first; i < end; ) {
+        int run = i + 1;
+        while (run < end && cur_attr[run] == cur_attr[i]) run++;
+        int want = cur_attr[i];
+        /* Blanks between two runs of one syntax colour need no switch */
+        if (want == ATTR_NONE && attr >= ATTR_COMMENT && run < end && cur_attr[run] == attr) {
+            int k = i;
+            while (k < run && cur[k] == ' ') k++;
+            if (k == run) want = attr;
+        }
+        if (want != attr) {
+            attr = want;
+            out_str(s_attr_sgr[attr]);
+        }
+        out_cells(cur + i, run - i);
+        i = run;
+    }
+    if (attr != ATTR_NONE) out_str(s_attr_sgr[ATTR_NONE]);
+    if (use_el) out_str(ESC_EL);
+
+    memcpy(old + first, cur + first, (last - first + 1) * sizeof(*old));
+    memcpy(old_attr + first, cur_attr + first, last - first + 1);
+}
+
+/* Flag occurrences of the search pattern in bytes [start, start + span) */
+static void highlight_matches(int file_row, int start, int span) {
+    int m = s_pat.len;
+    int len = line_len(file_row);
+    int from = start - m + 1;
+    int to = start + span + m - 1;
+    if (from < 0) from = 0;
+    if (to > len) to = len;
+    if (to - from < m) return;
+
+    const char *text = line_peek(file_row);
+    for (int col = from; (col = pat_find(text, to, col)) >= 0; col++) {
+        for (int i = col; i < col + m; i++) {
+            int x = i - start;
+            if (x >= 0 && x < span) s_row_attr[x] = ATTR_MATCH;
+        }
+    }
+}
+
+static void render_text_row(int y) {
+    int text_cols = E.screen_cols;
+    int file_row = E.top_line + y;
+    int x = 0;
+
+    if (file_row < E.line_count) {
+        /* Visible bytes, attributes per byte */
+        int len = line_len(file_row);
+        int start = utf_byte(file_row, E.left_col);
+        int span = len - start;
+        if (span > text_cols * UTF_MAX) span = text_cols * UTF_MAX;
+        line_copy(file_row, start, span, s_row_text);
+        memset(s_row_attr, ATTR_NONE, span);
+        if (E.syntax) {
+            int state = file_row ? E.lines[file_row - 1].hl & HL_STATE : HL_NORMAL;
+            hl_lex(line_peek(file_row), len, state, s_row_attr, start, span);
+        }
+        if (E.search_hl && s_pat.len) highlight_matches(file_row, start, span);
+
+        /* One cell per character, coloured like its first byte */
+        for (int i = 0; i < span && x < text_cols; x++) {
+            int n = 1;
+            while (i + n < span && UTF_CONT(s_row_text[i + n])) n++;
+            s_row_buf[x] = utf_cell(s_row_text + i, n);
+            s_row_attr[x] = s_row_attr[i];
+            i += n;
         }
+    } else {
+        /* Empty row - show tilde like vi */
+        s_row_buf[x] = '~';
+        s_row_attr[x++] = ATTR_NONE;
+    }
+    for (; x < text_cols; x++) {
+        s_row_buf[x] = ' ';
+        s_row_attr[x] = ATTR_NONE;
     }
+}
 
-    /* Draw status line */
-    out_goto(E.screen_rows - 1, 0);
-    out_str(ESC_REVERSE);
+/* Decode s into status cells from pos up to max; returns the next pos */
+static int compose_text(int pos, const char *s, int max) {
+    for (int i = 0; s[i] && pos < max; pos++) {
+        int n = 1;
+        while (s[i + n] && UTF_CONT(s[i + n])) n++;
+        s_row_buf[pos] = utf_cell(s + i, n);
+        i += n;
+    }
+    return pos;
+}
 
+static void render_status_row(void) {
     char status_left[128];
     char status_right[64];
 
@@ -526,7 +3118,10 @@ static void draw_screen(void) {
     }
 
     if (E.mode == MODE_COMMAND) {
-        snprintf(status_left, sizeof(status_left), ":%s", E.cmd_buf);
+        snprintf(status_left, sizeof(status_left), ":%.126s", E.cmd_buf);
+    } else if (E.mode == MODE_SEARCH) {
+        snprintf(status_left, sizeof(status_left), "%c%.126s",
+                 E.search_dir > 0 ? '/' : '?', E.cmd_buf);
     } else if (E.status[0]) {
         snprintf(status_left, sizeof(status_left), "%s", E.status);
     } else {
@@ -536,77 +3131,453 @@ static void draw_screen(void) {
                  E.modified ? " [+]" : "");
     }
 
-    /* Right side: line/col */
-    snprintf(status_right, sizeof(status_right), "%d,%d",
-             E.cur_row + 1, E.cur_col + 1);
+    /* Right side: line/col, plus the screen column where it differs */
+    int col = utf_col(E.cur_row, E.cur_col);
+    if (col == E.cur_col) {
+        snprintf(status_right, sizeof(status_right), "%d,%d", E.cur_row + 1, E.cur_col + 1);
+    } else {
+        snprintf(status_right, sizeof(status_right), "%d,%d-%d",
+                 E.cur_row + 1, E.cur_col + 1, col + 1);
+    }
 
-    int left_len = strlen(status_left);
-    int right_len = strlen(status_right);
+    int left_len = utf_width(status_left);
+    int right_len = utf_width(status_right);
     /* Use screen_cols - 1 to avoid writing the very last character,
      * which would trigger vterm auto-scroll on ESP32 */
     int status_width = E.screen_cols - 1;
     int padding = status_width - left_len - right_len;
     if (padding < 0) padding = 0;
 
-    /* Output exactly status_width characters */
-    int pos = 0;
-    for (int i = 0; i < left_len && pos < status_width; i++, pos++) {
-        out_char(status_left[i]);
-    }
+    /* Compose exactly status_width characters */
+    memset(s_row_attr, ATTR_STATUS, status_width);
+    int pos = compose_text(0, status_left, status_width);
     for (int i = 0; i < padding && pos < status_width; i++, pos++) {
-        out_char(' ');
+        s_row_buf[pos] = ' ';
+    }
+    compose_text(pos, status_right, status_width);
+}
+
+static void draw_screen(void) {
+    int text_rows = E.screen_rows - 1;
+
+    adjust_viewport();
+    line_exists(E.top_line + text_rows - 1);
+    if (E.syntax) hl_sync(E.top_line + text_rows);
+    if (E.top_line != s_drawn_top || E.left_col != s_drawn_left) {
+        mark_all_dirty();
+        s_drawn_top = E.top_line;
+        s_drawn_left = E.left_col;
     }
-    for (int i = 0; i < right_len && pos < status_width; i++, pos++) {
-        out_char(status_right[i]);
+
+    s_cursor_hidden = 0;
+
+    for (int y = 0; y < text_rows; y++) {
+        if (!s_row_dirty[y]) continue;
+        s_row_dirty[y] = 0;
+        render_text_row(y);
+        flush_row(y, E.screen_cols);
     }
 
-    out_str(ESC_RESET);
+    /* Status line is one row; always compose it and let the diff decide */
+    render_status_row();
+    flush_row(E.screen_rows - 1, E.screen_cols - 1);
 
     /* Position cursor */
     int screen_row = E.cur_row - E.top_line;
-    int screen_col = E.cur_col - E.left_col;
-    out_goto(screen_row, screen_col);
-    out_str(ESC_CURSOR_SHOW);
+    int screen_col = utf_col(E.cur_row, E.cur_col) - E.left_col;
+    if (s_cursor_hidden || screen_row != s_drawn_crow || screen_col != s_drawn_ccol) {
+        out_goto(screen_row, screen_col);
+        s_drawn_crow = screen_row;
+        s_drawn_ccol = screen_col;
+    }
+    if (s_cursor_hidden) out_str(ESC_CURSOR_SHOW);
 
     out_flush();
 }
 
+/*
+ * Terminal size changed. Cells inside both the old and the new geometry
+ * keep their shadow, so the next draw rewrites only what the new layout
+ * moves (mostly the status line); cells the terminal just exposed are
+ * marked unknown and get painted. No clear, so no flash.
+ */
+static void screen_resize(void) {
+    int old_rows = E.screen_rows;
+    int old_cols = E.screen_cols;
+    int rows, cols;
+
+    plat_get_size(&rows, &cols);
+    if (rows < 2) rows = 2;             /* One text row plus status */
+    if (cols < 1) cols = 1;
+    if (rows == old_rows && cols == old_cols) return;
+
+    unsigned *old = s_shadow;
+    unsigned char *old_attr = s_shadow_attr;
+    s_shadow = NULL;
+    s_shadow_attr = NULL;
+    screen_free();
+
+    E.screen_rows = rows;
+    E.screen_cols = cols;
+    screen_init();
+    memset(s_shadow_attr, ATTR_UNKNOWN, rows * cols);
+
+    /*
+     * A terminal shrinking below its cursor scrolls the contents up, so
+     * the old cells are only trusted when the cursor stayed on screen.
+     */
+    if (s_drawn_crow >= 0 && s_drawn_crow < rows) {
+        int keep_rows = rows < old_rows ? rows : old_rows;
+        int keep_cols = cols < old_cols ? cols : old_cols;
+        for (int y = 0; y < keep_rows; y++) {
+            memcpy(&s_shadow[y * cols], &old[y * old_cols], keep_cols * sizeof(*old));
+            memcpy(&s_shadow_attr[y * cols], &old_attr[y * old_cols], keep_cols);
+        }
+    }
+    free(old);
+    free(old_attr);
+    s_drawn_crow = -1;
+}
+
+/* ========== Ex Commands ========== */
+/*
+ * Ranged commands: [range]s/pat/rep/[g], [range]g/pat/d, [range]v/pat/d,
+ * [range]d, [line]r file and a bare [line] to jump. A range is %, or one
+ * or two addresses (N, ., $, each with +N/-N). Patterns are literal, as
+ * for /. Each command is one pass over the line array; the redraw after
+ * it only touches the rows that are on screen.
+ */
+static char *s_ex_buf;          /* Scratch for rewritten text */
+static int s_ex_cap;
+
+static int ex_reserve(int n) {
+    if (n <= s_ex_cap) return 1;
+    int cap = s_ex_cap ? s_ex_cap : 256;
+    while (cap < n) cap *= 2;
+    char *buf = realloc(s_ex_buf, cap);
+    if (!buf) return 0;
+    s_ex_buf = buf;
+    s_ex_cap = cap;
+    return 1;
+}
+
+/* One address at p; sets *row (0-based) and returns the text after it */
+static const char *ex_address(const char *p, int *row, int *given) {
+    *given = 1;
+    if (isdigit((unsigned char)*p)) {
+        *row = (int)strtol(p, (char **)&p, 10) - 1;
+    } else if (*p == '.') {
+        *row = E.cur_row;
+        p++;
+    } else if (*p == '$') {
+        index_all();
+        *row = E.line_count - 1;
+        p++;
+    } else {
+        *given = 0;
+        *row = E.cur_row;
+    }
+    while (*p == '+' || *p == '-') {
+        int sign = *p++ == '+' ? 1 : -1;
+        int n = isdigit((unsigned char)*p) ? (int)strtol(p, (char **)&p, 10) : 1;
+        *row += sign * n;
+        *given = 1;
+    }
+    return p;
+}
+
+/* Split "/pat/rep/flags" at unescaped delimiters into dst; returns the rest */
+static const char *ex_field(const char *p, char delim, char *dst, int max) {
+    int n = 0;
+    while (*p && *p != delim) {
+        if (*p == '\\' && p[1] == delim) p++;
+        if (n < max - 1) dst[n++] = *p;
+        p++;
+    }
+    dst[n] = '\0';
+    return *p ? p + 1 : p;
+}
+
+/* Use pat, or the last search pattern if it is empty */
+static int ex_pattern(const char *pat) {
+    if (pat[0]) pat_compile(pat);
+    if (s_pat.len == 0) {
+        snprintf(E.status, sizeof(E.status), "No previous pattern");
+        return 0;
+    }
+    return 1;
+}
+
+static void ex_substitute(int top, int bottom, const char *rep, int global) {
+    int m = s_pat.len, rep_len = strlen(rep);
+    int lines = 0, last = -1;
+    long subs = 0;
+
+    for (int row = top; row <= bottom; row++) {
+        int len = line_len(row);
+        const char *text = line_text(row);
+        int col = pat_find(text, len, 0);
+        if (col < 0) continue;
+
+        /* Rewrite the span from the first match to the end of the last */
+        int first = col, end = col, out = 0;
+        do {
+            if (!ex_reserve(out + (col - end) + rep_len)) return;
+            memcpy(s_ex_buf + out, text + end, col - end);
+            out += col - end;
+            memcpy(s_ex_buf + out, rep, rep_len);
+            out += rep_len;
+            end = col + m;
+            subs++;
+        } while (global && (col = pat_find(text, len, end)) >= 0);
+
+        line_splice(row, first, end - first, s_ex_buf, out);
+        lines++;
+        last = row;
+    }
+
+    if (last < 0) {
+        snprintf(E.status, sizeof(E.status), "Pattern not found: %.100s", s_pat.text);
+        return;
+    }
+    E.cur_row = last;
+    E.cur_col = first_nonblank(last);
+    E.modified = 1;
+    snprintf(E.status, sizeof(E.status), "%ld substitutions on %d lines", subs, lines);
+}
+
+/*
+ * Delete lines in [top, bottom] that match (or with invert, do not) by
+ * compacting the line array in place. Each run of deleted lines becomes
+ * one journal record at the row it occupied when it went.
+ */
+static void ex_global_delete(int top, int bottom, int invert) {
+    int keep = top, deleted = 0;
+
+    for (int row = top; row <= bottom; ) {
+        if ((pat_find(line_text(row), line_len(row), 0) >= 0) == invert) {
+            E.lines[keep++] = E.lines[row++];
+            continue;
+        }
+        int run = row;
+        while (row <= bottom && (pat_find(line_text(row), line_len(row), 0) >= 0) != invert) {
+            row++;
+        }
+        int n = row - run;
+        swap_log(UNDO_LINE_DEL, keep, n, NULL, 0);
+        char *dst = undo_reserve(UNDO_LINE_DEL, keep, n, lines_size(run, n));
+        if (dst) lines_copy_out(run, n, dst);
+        for (int i = run; i < row; i++) pool_free(E.lines[i].buf, E.lines[i].cap);
+        deleted += n;
+    }
+    if (!deleted) {
+        snprintf(E.status, sizeof(E.status), "Pattern not found: %.100s", s_pat.text);
+        return;
+    }
+
+    memmove(&E.lines[keep], &E.lines[bottom + 1], (E.line_count - bottom - 1) * sizeof(line_t));
+    E.line_count -= deleted;
+    if (E.hl_valid > top) E.hl_valid = top;
+    cmap_forget(top);
+    if (E.line_count == 0 && !line_exists(0)) insert_line_at(0, "", 0);
+    mark_lines_dirty_from(top);
+
+    E.cur_row = keep < E.line_count ? keep : E.line_count - 1;
+    E.cur_col = first_nonblank(E.cur_row);
+    E.modified = 1;
+    snprintf(E.status, sizeof(E.status), "%d fewer lines", deleted);
+}
+
+/* Insert the lines of path below row (-1 for the top) as one block */
+static void ex_read(int row, const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        snprintf(E.status, sizeof(E.status), "Cannot open %s", path);
+        return;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if (size < 0 || !ex_reserve(size + 1)) {
+        fclose(f);
+        return;
+    }
+    long len = fread(s_ex_buf, 1, size, f);
+    fclose(f);
+
+    /* Shape it the way insert_lines_at() takes it: no CRs, no final newline */
+    long w = 0;
+    int lines = 1;
+    for (long i = 0; i < len; i++) {
+        char c = s_ex_buf[i];
+        if (c == '\r' && (i + 1 == len || s_ex_buf[i + 1] == '\n')) continue;
+        if (c == '\n') lines++;
+        s_ex_buf[w++] = c;
+    }
+    if (w > 0 && s_ex_buf[w - 1] == '\n') {
+        w--;
+        lines--;
+    }
+    if (len == 0) {
+        snprintf(E.status, sizeof(E.status), "\"%s\" 0 lines", path);
+        return;
+    }
+
+    insert_lines_at(row + 1, s_ex_buf, w, lines);
+    E.cur_row = row + 1;
+    E.cur_col = first_nonblank(E.cur_row);
+    E.modified = 1;
+    snprintf(E.status, sizeof(E.status), "\"%s\" %d lines", path, lines);
+}
+
+/* Run cmd if it is a ranged command; returns 0 to let the caller try it */
+static int ex_run(const char *cmd) {
+    const char *p = cmd;
+    int top, bottom, given;
+
+    if (*p == '%') {
+        index_all();
+        top = 0;
+        bottom = E.line_count - 1;
+        given = 1;
+        p++;
+    } else {
+        p = ex_address(p, &top, &given);
+        bottom = top;
+        if (given && *p == ',') {
+            int given2;
+            p = ex_address(p + 1, &bottom, &given2);
+        }
+    }
+    if (top > bottom) {
+        int t = top;
+        top = bottom;
+        bottom = t;
+    }
+    if (bottom >= 0 && !line_exists(bottom)) bottom = E.line_count - 1;
+
+    char pat[CMD_BUF_SIZE], rep[CMD_BUF_SIZE];
+    if (*p == '\0') {
+        if (!given) return 0;
+        /* :N jumps to line N */
+        E.cur_row = bottom < 0 ? 0 : bottom;
+        E.cur_col = first_nonblank(E.cur_row);
+        return 1;
+    }
+    if (*p == 'r' && (p[1] == ' ' || p[1] == '\0')) {
+        while (*++p == ' ') {}
+        if (!*p) snprintf(E.status, sizeof(E.status), "No file name");
+        else ex_read(bottom, p);
+        return 1;
+    }
+    if (top < 0) {
+        snprintf(E.status, sizeof(E.status), "Invalid range");
+        return 1;
+    }
+    if (*p == 's' && p[1] && !isalnum((unsigned char)p[1]) && p[1] != ' ') {
+        char delim = p[1];
+        p = ex_field(p + 2, delim, pat, sizeof(pat));
+        p = ex_field(p, delim, rep, sizeof(rep));
+        if (ex_pattern(pat)) ex_substitute(top, bottom, rep, *p == 'g');
+        return 1;
+    }
+    if ((*p == 'g' || *p == 'v') && p[1] && (p[1] == '!' || !isalnum((unsigned char)p[1]))) {
+        int invert = *p == 'v';
+        if (p[1] == '!') {
+            invert = !invert;
+            p++;
+        }
+        char delim = p[1];
+        p = ex_field(p + 2, delim, pat, sizeof(pat));
+        if (strcmp(p, "d") != 0) {
+            snprintf(E.status, sizeof(E.status), "Only :g/pattern/d is supported");
+            return 1;
+        }
+        if (!given) {
+            index_all();
+            top = 0;
+            bottom = E.line_count - 1;
+        }
+        if (ex_pattern(pat)) ex_global_delete(top, bottom, invert);
+        return 1;
+    }
+    if (strcmp(p, "d") == 0) {
+        operate_lines('d', 0, top, bottom - top + 1);
+        return 1;
+    }
+    return 0;
+}
+
 /* ========== Mode Handlers ========== */
 static void handle_normal(int key) {
     E.status[0] = '\0';  /* Clear status on keypress */
+    undo_boundary();     /* Each normal-mode command is one undoable change */
+
+    /* Second key of a two-key prefix */
+    if (s_cmd.prefix == '"') {
+        s_cmd.prefix = 0;
+        if (key >= 'a' && key <= 'z') s_cmd.reg = key;
+        else memset(&s_cmd, 0, sizeof(s_cmd));
+        return;
+    }
+    if (s_cmd.prefix == 'g') {
+        s_cmd.prefix = 0;
+        if (key != 'g') {
+            memset(&s_cmd, 0, sizeof(s_cmd));
+            return;
+        }
+    } else if ((key >= '1' && key <= '9') || (key == '0' && s_cmd.count)) {
+        if (s_cmd.count < 1000000) s_cmd.count = s_cmd.count * 10 + key - '0';
+        return;
+    } else if (key == '"' || key == 'g') {
+        s_cmd.prefix = key;
+        return;
+    }
+
+    int has_count = s_cmd.count || s_cmd.op_count;
+    int n = (s_cmd.count ? s_cmd.count : 1) * (s_cmd.op_count ? s_cmd.op_count : 1);
+    int reg = s_cmd.reg;
+    int op = s_cmd.op;
+    int row = E.cur_row, col = E.cur_col, linewise, inclusive;
+
+    if (op) {
+        memset(&s_cmd, 0, sizeof(s_cmd));
+        if (key == op) {
+            operate_lines(op, reg, E.cur_row, n);   /* dd, cc, yy */
+            return;
+        }
+        /* cw on a word changes to its end, like ce */
+        if (op == 'c' && key == 'w' && col < line_len(row) &&
+            char_class((unsigned char)line_text(row)[col])) {
+            key = 'e';
+        }
+        if (motion_target(key, n, has_count, &row, &col, &linewise, &inclusive)) {
+            operate(op, reg, row, col, linewise, inclusive);
+        }
+        return;     /* Anything else cancels the operator */
+    }
+    if (key == 'd' || key == 'c' || key == 'y') {
+        s_cmd.op = key;
+        s_cmd.op_count = s_cmd.count;
+        s_cmd.count = 0;
+        return;
+    }
+    memset(&s_cmd, 0, sizeof(s_cmd));
+
+    if (motion_target(key, n, has_count, &row, &col, &linewise, &inclusive)) {
+        E.cur_row = row;
+        E.cur_col = col;
+        clamp_cursor();
+        return;
+    }
 
     switch (key) {
-        case 'h':
-        case KEY_LEFT:
-            move_left();
-            break;
-        case 'j':
-        case KEY_DOWN:
-            move_down();
-            break;
-        case 'k':
-        case KEY_UP:
-            move_up();
-            break;
-        case 'l':
-        case KEY_RIGHT:
-            move_right();
-            break;
-        case '0':
-        case KEY_HOME:
-            E.cur_col = 0;
-            break;
-        case '$':
-        case KEY_END:
-            E.cur_col = line_len(E.cur_row);
-            clamp_cursor();
-            break;
         case 'i':
             E.mode = MODE_INSERT;
             break;
         case 'a':
             /* Append after cursor */
-            E.cur_col++;
+            E.cur_col = utf_step(E.cur_row, E.cur_col, 1);
             clamp_cursor();
             E.mode = MODE_INSERT;
             break;
@@ -617,7 +3588,7 @@ static void handle_normal(int key) {
             break;
         case 'o':
             /* Open line below */
-            insert_line_at(E.cur_row + 1, "");
+            insert_line_at(E.cur_row + 1, "", 0);
             E.cur_row++;
             E.cur_col = 0;
             E.mode = MODE_INSERT;
@@ -625,37 +3596,62 @@ static void handle_normal(int key) {
             break;
         case 'O':
             /* Open line above */
-            insert_line_at(E.cur_row, "");
+            insert_line_at(E.cur_row, "", 0);
             E.cur_col = 0;
             E.mode = MODE_INSERT;
             E.modified = 1;
             break;
         case 'x':
-            /* Delete char at cursor */
-            if (line_len(E.cur_row) > 0) {
-                delete_char_at(E.cur_col);
-                clamp_cursor();
-            }
+            /* dl: delete n chars at cursor */
+            operate('d', reg, row, utf_step(row, col, n), 0, 0);
             break;
-        case 'd':
-            /* dd - delete line (simple: just 'd' deletes line) */
-            delete_line_at(E.cur_row);
-            clamp_cursor();
+        case 'X':
+            /* dh: delete n chars before cursor */
+            operate('d', reg, row, utf_step(row, col, -n), 0, 0);
+            break;
+        case 'D':
+        case 'C':
+            /* d$, c$ */
+            operate(key == 'D' ? 'd' : 'c', reg, row, line_len(row), 0, 0);
+            break;
+        case 'Y':
+            operate_lines('y', reg, row, n);
+            break;
+        case 'p':
+        case 'P':
+            put_register(reg, key == 'p', n);
             break;
         case ':':
             E.mode = MODE_COMMAND;
             E.cmd_buf[0] = '\0';
             E.cmd_len = 0;
             break;
-        case 'G':
-            /* Go to last line */
-            E.cur_row = E.line_count - 1;
-            clamp_cursor();
+        case '/':
+            search_start(1);
             break;
-        case 'g':
-            /* gg - go to first line (simple: just 'g') */
-            E.cur_row = 0;
-            E.cur_col = 0;
+        case '?':
+            search_start(-1);
+            break;
+        case 'n':
+        case 'N':
+            while (n-- > 0) search_next(key == 'n' ? 1 : -1);
+            break;
+        case KEY_ESC:
+            search_show(0);
+            break;
+        case 'u':
+            while (n-- > 0) undo();
+            break;
+        case CTRL_KEY('r'):
+            while (n-- > 0) redo();
+            break;
+        case CTRL_KEY('f'):
+        case KEY_PAGE_DOWN:
+            move_pages(n);
+            break;
+        case CTRL_KEY('b'):
+        case KEY_PAGE_UP:
+            move_pages(-n);
             break;
     }
 }
@@ -664,7 +3660,7 @@ static void handle_insert(int key) {
     switch (key) {
         case KEY_ESC:
             E.mode = MODE_NORMAL;
-            if (E.cur_col > 0) E.cur_col--;  /* vi behavior */
+            E.cur_col = utf_step(E.cur_row, E.cur_col, -1);  /* vi behavior */
             clamp_cursor();
             break;
         case KEY_UP:
@@ -695,8 +3691,38 @@ static void handle_insert(int key) {
             E.cur_col = line_len(E.cur_row);
             break;
         default:
-            if (key >= 32 && key < 127) {
-                insert_char((char)key);
+            if (TEXT_KEY(key)) {
+                /* Pasted text arrives as a run; insert it in one go */
+                char run[PASTE_RUN];
+                run[0] = (char)key;
+                insert_text(run, 1 + input_take_text(run + 1, sizeof(run) - 1));
+            }
+            break;
+    }
+}
+
+static void handle_search(int key) {
+    switch (key) {
+        case KEY_ESC:
+            search_cancel();
+            break;
+        case KEY_ENTER:
+            search_accept();
+            break;
+        case KEY_BACKSPACE:
+            if (E.cmd_len == 0) {
+                search_cancel();
+                break;
+            }
+            do E.cmd_len--; while (E.cmd_len > 0 && UTF_CONT(E.cmd_buf[E.cmd_len]));
+            E.cmd_buf[E.cmd_len] = '\0';
+            search_incremental();
+            break;
+        default:
+            if (TEXT_KEY(key) && E.cmd_len < CMD_BUF_SIZE - 1) {
+                E.cmd_buf[E.cmd_len++] = (char)key;
+                E.cmd_buf[E.cmd_len] = '\0';
+                search_incremental();
             }
             break;
     }
@@ -708,10 +3734,17 @@ static void exec_command(void) {
     /* Skip leading spaces */
     while (*cmd == ' ') cmd++;
 
-    if (strcmp(cmd, "q") == 0) {
+    if (ex_run(cmd)) {
+        /* Ranged command, handled */
+    } else if (strcmp(cmd, "q") == 0) {
+        int other = buf_find_modified();
         if (E.modified) {
             snprintf(E.status, sizeof(E.status),
                      "No write since last change (add ! to override)");
+        } else if (other >= 0) {
+            buf_switch(other);
+            snprintf(E.status, sizeof(E.status),
+                     "No write since last change for buffer \"%.80s\"", buf_name(other));
         } else {
             E.running = 0;
         }
@@ -722,11 +3755,19 @@ static void exec_command(void) {
     } else if (strncmp(cmd, "w ", 2) == 0) {
         save_file(cmd + 2);
     } else if (strcmp(cmd, "wq") == 0 || strcmp(cmd, "x") == 0) {
+        int other = buf_find_modified();
         if (save_file(NULL)) {
-            E.running = 0;
+            if (other >= 0) buf_switch(other);
+            else E.running = 0;
         }
+    } else if (strncmp(cmd, "e ", 2) == 0 && cmd[2]) {
+        buf_edit(cmd + 2);
+    } else if (strcmp(cmd, "bn") == 0) {
+        buf_switch((s_buf_cur + 1) % s_buf_count);
+    } else if (strcmp(cmd, "bp") == 0) {
+        buf_switch((s_buf_cur + s_buf_count - 1) % s_buf_count);
     } else if (cmd[0] != '\0') {
-        snprintf(E.status, sizeof(E.status), "Unknown command: %s", cmd);
+        snprintf(E.status, sizeof(E.status), "Unknown command: %.100s", cmd);
     }
 }
 
@@ -742,13 +3783,14 @@ static void handle_command(int key) {
             break;
         case KEY_BACKSPACE:
             if (E.cmd_len > 0) {
-                E.cmd_buf[--E.cmd_len] = '\0';
+                do E.cmd_len--; while (E.cmd_len > 0 && UTF_CONT(E.cmd_buf[E.cmd_len]));
+                E.cmd_buf[E.cmd_len] = '\0';
             } else {
                 E.mode = MODE_NORMAL;
             }
             break;
         default:
-            if (key >= 32 && key < 127 && E.cmd_len < CMD_BUF_SIZE - 1) {
+            if (TEXT_KEY(key) && E.cmd_len < CMD_BUF_SIZE - 1) {
                 E.cmd_buf[E.cmd_len++] = (char)key;
                 E.cmd_buf[E.cmd_len] = '\0';
             }
@@ -756,52 +3798,677 @@ static void handle_command(int key) {
     }
 }
 
+/* Answer to the swap file prompt shown on open */
+static void handle_recover(int key) {
+    char path[sizeof(E.filepath) + 8];
+    switch (key) {
+        case 'r':
+            swap_recover();
+            if (s_swap.found) return;   /* Stale; still needs e or d */
+            break;
+        case 'e':
+            snprintf(E.status, sizeof(E.status), "Swap file kept; edits are not journaled");
+            break;
+        case 'd':
+            swap_path(path, sizeof(path));
+            remove(path);
+            s_swap.armed = 1;
+            E.status[0] = '\0';
+            break;
+        default:
+            return;
+    }
+    s_swap.found = 0;
+    E.mode = MODE_NORMAL;
+}
+
+static void process_key(int key) {
+    switch (E.mode) {
+        case MODE_NORMAL:
+            handle_normal(key);
+            break;
+        case MODE_INSERT:
+            handle_insert(key);
+            break;
+        case MODE_COMMAND:
+            handle_command(key);
+            break;
+        case MODE_SEARCH:
+            handle_search(key);
+            break;
+        case MODE_RECOVER:
+            handle_recover(key);
+            break;
+    }
+}
+
+/* ========== Benchmarks ========== */
+#ifdef VI_BENCH
+#include <sys/wait.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+static void bench_report(const char *name, long long us, long ops) {
+    printf("%-28s %8lld us  %8.1f ns/op\n", name, us, us * 1000.0 / (ops ? ops : 1));
+}
+
+static void bench_reset(void) {
+    free_all_lines();
+    insert_line_at(0, "", 0);
+    E.cur_row = E.cur_col = 0;
+}
+
+/* Type n characters into one line, cursor in the middle after the first half */
+static void bench_insert_one_line(int n) {
+    bench_reset();
+    long long t0 = plat_time_us();
+    for (int i = 0; i < n; i++) {
+        char c = 'a' + i % 26;
+        if (i == n / 2) E.cur_col = n / 4;
+        insert_text(&c, 1);
+    }
+    bench_report("insert_text, one line", plat_time_us() - t0, n);
+}
+
+/* Type n characters as lines of width chars each */
+static void bench_insert_many_lines(int n, int width) {
+    bench_reset();
+    long long t0 = plat_time_us();
+    for (int i = 0; i < n; i++) {
+        char c = 'a' + i % 26;
+        if (i % width == width - 1) insert_newline();
+        else insert_text(&c, 1);
+    }
+    bench_report("insert_text, many lines", plat_time_us() - t0, n);
+}
+
+/* BMH kernel over one contiguous buffer vs a naive first-byte + memcmp scan */
+static void bench_search_kernel(int size) {
+    char *hay = malloc(size);
+    for (int i = 0; i < size; i++) hay[i] = (i % 71 == 70) ? '\n' : 'a' + (i * 7) % 26;
+    pat_compile("needle in haystack");
+
+    long long t0 = plat_time_us();
+    int hit = pat_find(hay, size, 0);
+    bench_report("pat_find, 10 MB miss", plat_time_us() - t0, size);
+
+    t0 = plat_time_us();
+    int m = s_pat.len;
+    for (int i = 0; i <= size - m; i++) {
+        if (hay[i] == s_pat.text[0] && memcmp(hay + i, s_pat.text, m) == 0) {
+            hit = i;
+            break;
+        }
+    }
+    bench_report("naive scan, 10 MB miss", plat_time_us() - t0, size);
+    if (hit >= 0) printf("unexpected match at %d\n", hit);
+    free(hay);
+}
+
+/* Whole-buffer search through the line storage, wrapping once */
+static void bench_search_lines(int lines) {
+    char text[72];
+    bench_reset();
+    for (int i = 0; i < 71; i++) text[i] = 'a' + (i * 7 + lines) % 26;
+    for (int i = 0; i < lines; i++) insert_line_at(i, text, 70);
+    pat_compile("needle");
+
+    int row, col;
+    long long t0 = plat_time_us();
+    search_from(0, 0, 1, 0, &row, &col);
+    bench_report("search_from, 10 MB in lines", plat_time_us() - t0, (long)lines * 71);
+}
+
+/* 500dd and p of the result in the middle of a large buffer, against one line at a time */
+static void bench_line_block(int lines, int block) {
+    bench_reset();
+    for (int i = 0; i < lines; i++) insert_line_at(i, "some text on every line", 23);
+
+    long long t0 = plat_time_us();
+    for (int i = 0; i < block; i++) delete_line_at(lines / 2);
+    bench_report("delete_line_at x 500", plat_time_us() - t0, block);
+    undo_boundary();
+    undo();
+
+    E.cur_row = lines / 2;
+    t0 = plat_time_us();
+    operate_lines('d', 0, E.cur_row, block);
+    bench_report("500dd, one block", plat_time_us() - t0, block);
+
+    undo_boundary();
+    t0 = plat_time_us();
+    put_register(0, 1, 1);
+    bench_report("p of 500 lines", plat_time_us() - t0, block);
+    regs_free();
+}
+
+/* Cold lex of a C buffer, then a keystroke's resync near the top */
+static void bench_highlight(int lines) {
+    static const char *const src[] = {
+        "static int parse(const char *s, int n) {  /* entry */",
+        "    for (int i = 0; i < n; i++) if (s[i] == '\\n') return i;",
+        "    return printf(\"%d items\\n\", n) + 0x10; // done",
+        "}",
+    };
+    bench_reset();
+    for (int i = 0; i < lines; i++) insert_line_at(i, src[i % 4], strlen(src[i % 4]));
+    E.syntax = SYN_C;
+
+    long long t0 = plat_time_us();
+    hl_sync(lines);
+    bench_report("hl_sync, cold", plat_time_us() - t0, lines);
+
+    E.cur_row = 1;
+    E.cur_col = 4;
+    insert_text("x", 1);
+    t0 = plat_time_us();
+    hl_sync(lines);
+    bench_report("hl_sync, after edit", plat_time_us() - t0, lines);
+
+    E.syntax = SYN_NONE;
+}
+
+/* :%s as erase+insert per match versus one splice per line, then :g//d */
+static void bench_ex(int lines) {
+    static const char text[] = "some text on every line, every one";
+    bench_reset();
+    for (int i = 0; i < lines; i++) insert_line_at(i, text, sizeof(text) - 1);
+    pat_compile("every");
+
+    long long t0 = plat_time_us();
+    for (int row = 0; row < lines; row++) {
+        int col = 0;
+        while ((col = pat_find(line_text(row), line_len(row), col)) >= 0) {
+            line_erase(row, col, 5);
+            line_insert(row, col, "EACH", 4);
+            col += 4;
+        }
+    }
+    bench_report("s/every/EACH/g, per match", plat_time_us() - t0, lines);
+    undo_boundary();
+    undo();
+
+    t0 = plat_time_us();
+    ex_run("%s/every/EACH/g");
+    bench_report(":%s/every/EACH/g", plat_time_us() - t0, lines);
+
+    undo_boundary();
+    t0 = plat_time_us();
+    ex_run("g/EACH/d");
+    bench_report(":g/EACH/d", plat_time_us() - t0, lines);
+}
+
+static long bench_heap_in_use(void) {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    return (long)mallinfo2().uordblks;
+#else
+    return 0;
+#endif
+}
+
+/* Heap taken by n short lines, one malloc each versus the pool */
+static void bench_pool(int n) {
+    char **ptrs = malloc(n * sizeof(char *));
+    free_all_lines();
+    pool_release();
+
+    long base = bench_heap_in_use();
+    for (int i = 0; i < n; i++) ptrs[i] = malloc(1 + i % 80);
+    long heap = bench_heap_in_use() - base;
+    for (int i = 0; i < n; i++) free(ptrs[i]);
+
+    base = bench_heap_in_use();
+    for (int i = 0; i < n; i++) ptrs[i] = pool_alloc(pool_cap(1 + i % 80));
+    long pooled = bench_heap_in_use() - base;
+    for (int i = 0; i < n; i++) pool_free(ptrs[i], pool_cap(1 + i % 80));
+
+    free(ptrs);
+    printf("%-28s %8ld bytes malloc, %ld bytes pooled (%d lines)\n",
+           "line storage", heap, pooled, n);
+}
+
+/* Round-robin between buffers of lines lines each */
+static void bench_buffers(int buffers, int lines, int switches) {
+    free_all_lines();
+    free(s_undo.arena);
+    s_undo.arena = NULL;
+    for (int b = 0; b < buffers; b++) {
+        buf_edit(NULL);
+        for (int i = 0; i < lines; i++) insert_line_at(i, "some buffer text", 16);
+    }
+
+    long long t0 = plat_time_us();
+    for (int i = 0; i < switches; i++) buf_switch(i % buffers);
+    bench_report("buf_switch", plat_time_us() - t0, switches);
+
+    buf_close_all(0);
+}
+
+/* Read from the pty until it stays quiet for quiet_ms; returns bytes read */
+static long bench_drain(int fd, int quiet_ms) {
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    char buf[4096];
+    long total = 0;
+    while (poll(&pfd, 1, quiet_ms) > 0) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n <= 0) break;
+        total += n;
+    }
+    return total;
+}
+
+static void bench_set_size(int fd, int rows, int cols) {
+    struct winsize w;
+    memset(&w, 0, sizeof(w));
+    w.ws_row = rows;
+    w.ws_col = cols;
+    ioctl(fd, TIOCSWINSZ, &w);
+}
+
+/*
+ * Run this binary as an editor on a pty, cycle the window through a few
+ * sizes and count what each resize costs on the wire.
+ */
+static void bench_resize(const char *exe, int resizes) {
+    static const int sizes[][2] = { { 24, 80 }, { 30, 100 }, { 20, 60 }, { 40, 132 } };
+    char path[] = "/tmp/vi-bench-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) return;
+    FILE *f = fdopen(fd, "w");
+    for (int i = 0; i < 2000; i++) {
+        fprintf(f, "%08d resize bench line with enough text to reach past column eighty %d\n", i, i * 7);
+    }
+    fclose(f);
+
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0) {
+        printf("resize: no pty available\n");
+        unlink(path);
+        return;
+    }
+    bench_set_size(master, sizes[0][0], sizes[0][1]);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        setsid();
+        int slave = open(ptsname(master), O_RDWR);
+#ifdef TIOCSCTTY
+        ioctl(slave, TIOCSCTTY, 0);
+#endif
+        dup2(slave, STDIN_FILENO);
+        dup2(slave, STDOUT_FILENO);
+        dup2(slave, STDERR_FILENO);
+        close(master);
+        execl(exe, exe, path, (char *)NULL);
+        _exit(127);
+    }
+
+    long first = bench_drain(master, 300);
+    long total = 0, worst = 0, cells = 0;
+    for (int i = 1; i <= resizes; i++) {
+        const int *sz = sizes[i % 4];
+        bench_set_size(master, sz[0], sz[1]);
+        long n = bench_drain(master, 50);
+        total += n;
+        cells += sz[0] * sz[1];
+        if (n > worst) worst = n;
+    }
+
+    if (write(master, "\033:q!\r", 5) < 0) {}
+    bench_drain(master, 100);
+    waitpid(pid, NULL, 0);
+    close(master);
+    unlink(path);
+
+    printf("%-28s %8ld bytes first paint, %ld avg / %ld max per resize (%ld cells avg)\n",
+           "resize, pty", first, total / resizes, worst, cells / resizes);
+}
+
+/* Replay keys with vi -s against a fresh copy of a large file */
+static void bench_scenario(const char *exe, const char *name, const char *keys, long len) {
+    char path[] = "/tmp/vi-bench-XXXXXX";
+    char script[] = "/tmp/vi-keys-XXXXXX";
+    char report[] = "/tmp/vi-report-XXXXXX";
+    int fd = mkstemp(path);
+    int kfd = mkstemp(script);
+    int rfd = mkstemp(report);
+    if (fd < 0 || kfd < 0 || rfd < 0) return;
+
+    FILE *f = fdopen(fd, "w");
+    for (int i = 0; i < 100000; i++) {
+        fprintf(f, "%08d scenario line with some words in it, int x = %d; /* note */\n", i, i * 3);
+    }
+    fclose(f);
+    if (write(kfd, keys, len) < 0) {}
+    close(kfd);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(rfd, STDOUT_FILENO);
+        execl(exe, exe, "-s", script, path, (char *)NULL);
+        _exit(127);
+    }
+    waitpid(pid, NULL, 0);
+
+    /* The summary is the last line of the report */
+    char tail[256];
+    long size = lseek(rfd, 0, SEEK_END);
+    long from = size > (long)sizeof(tail) - 1 ? size - (long)sizeof(tail) + 1 : 0;
+    long n = pread(rfd, tail, sizeof(tail) - 1, from);
+    tail[n > 0 ? n : 0] = '\0';
+    char *last = tail;
+    for (char *p = tail; *p; p++) {
+        if (*p == '\n' && p[1]) last = p + 1;
+    }
+    printf("%-28s %s", name, strncmp(last, "total: ", 7) == 0 ? last + 7 : "failed\n");
+
+    close(rfd);
+    unlink(path);
+    unlink(script);
+    unlink(report);
+}
+
+/* Canned editing sessions: open, page, type, paste, save */
+static void bench_scenarios(const char *exe) {
+    static const char para[] =
+        "The quick brown fox jumps over the lazy dog while the editor redraws ";
+    char *keys = malloc(16384);
+    int n;
+
+    bench_scenario(exe, "open 100k lines", "", 0);
+
+    n = 0;
+    for (int i = 0; i < 200; i++) keys[n++] = CTRL_KEY('f');
+    bench_scenario(exe, "page x 200", keys, n);
+
+    n = 0;
+    keys[n++] = 'i';
+    for (int i = 0; i < 8; i++) {
+        memcpy(keys + n, para, sizeof(para) - 1);
+        n += sizeof(para) - 1;
+        keys[n++] = '\r';
+    }
+    keys[n++] = 27;
+    bench_scenario(exe, "type a paragraph", keys, n);
+
+    n = 0;
+    keys[n++] = 'i';
+    memcpy(keys + n, "\033[200~", 6);
+    n += 6;
+    while (n < 10240) {
+        memcpy(keys + n, para, sizeof(para) - 1);
+        n += sizeof(para) - 1;
+        keys[n++] = '\r';
+    }
+    memcpy(keys + n, "\033[201~\033", 7);
+    n += 7;
+    bench_scenario(exe, "paste 10 KB", keys, n);
+
+    bench_scenario(exe, "edit and save", "x:w\r", 4);
+    free(keys);
+}
+
+static int bench_main(const char *exe) {
+    E.screen_rows = 24;
+    E.screen_cols = 80;
+    screen_init();
+
+    bench_insert_one_line(100000);
+    bench_insert_many_lines(100000, 80);
+    bench_search_kernel(10 * 1024 * 1024);
+    bench_search_lines(10 * 1024 * 1024 / 71);
+    bench_line_block(100000, 500);
+    bench_highlight(100000);
+    bench_ex(100000);
+    bench_pool(100000);
+    bench_buffers(4, 10000, 100000);
+    bench_resize(exe, 40);
+    bench_scenarios(exe);
+
+    free_all_lines();
+    screen_free();
+    return 0;
+}
+#endif
+
+/* ========== Latency Measurement ========== */
+/*
+ * With -L, every input batch is timestamped when poll() wakes up and again
+ * once the resulting redraw has been written out. A summary is printed on
+ * exit. Buckets are upper bounds in microseconds.
+ */
+static const long s_lat_bounds[] = { 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000 };
+#define LAT_BUCKETS ((int)(sizeof(s_lat_bounds) / sizeof(s_lat_bounds[0])) + 1)
+
+static struct {
+    int enabled;
+    long long arrival;          /* 0 while no batch is waiting to be painted */
+    long count;
+    long total_us;
+    long max_us;
+    long hist[LAT_BUCKETS];
+} s_lat;
+
+static void lat_arrival(void) {
+    if (s_lat.enabled && !s_lat.arrival) s_lat.arrival = plat_time_us();
+}
+
+static void lat_painted(void) {
+    if (!s_lat.arrival) return;
+    long us = (long)(plat_time_us() - s_lat.arrival);
+    s_lat.arrival = 0;
+
+    int b = 0;
+    while (b < LAT_BUCKETS - 1 && us >= s_lat_bounds[b]) b++;
+    s_lat.hist[b]++;
+    s_lat.count++;
+    s_lat.total_us += us;
+    if (us > s_lat.max_us) s_lat.max_us = us;
+}
+
+static void lat_report(void) {
+    if (!s_lat.enabled || s_lat.count == 0) return;
+    printf("key-to-paint latency: %ld batches, avg %ld us, max %ld us\n",
+           s_lat.count, s_lat.total_us / s_lat.count, s_lat.max_us);
+    for (int b = 0; b < LAT_BUCKETS; b++) {
+        if (!s_lat.hist[b]) continue;
+        if (b < LAT_BUCKETS - 1) printf("  < %6ld us: %ld\n", s_lat_bounds[b], s_lat.hist[b]);
+        else printf("  >= %5ld us: %ld\n", s_lat_bounds[b - 1], s_lat.hist[b]);
+    }
+}
+
+/* ========== Headless Replay ========== */
+/*
+ * vi -s script [file...] replays the keys in script against a virtual
+ * HEADLESS_ROWS x HEADLESS_COLS screen. The escape stream is counted but
+ * not written anywhere, and each frame's byte count and time are printed
+ * to stdout. Frame 0 covers opening the files and the first paint. After
+ * that, each key is its own frame, as if typed. A bracketed paste
+ * (ESC [200~ ... ESC [201~) is one frame, because a terminal delivers it
+ * in one go.
+ */
+static int script_load(const char *path) {
+    FILE *f = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+    if (!f) return 0;
+    long cap = 4096;
+    char *keys = malloc(cap);
+    long len = 0, n;
+    while (keys && (n = fread(keys + len, 1, cap - len, f)) > 0) {
+        len += n;
+        if (len == cap) {
+            char *grown = realloc(keys, cap * 2);
+            if (!grown) break;
+            keys = grown;
+            cap *= 2;
+        }
+    }
+    if (f != stdin) fclose(f);
+    s_script.keys = keys;
+    s_script.len = len;
+    return keys != NULL;
+}
+
+/* End of the frame starting at pos: one key, one escape sequence or a paste */
+static long script_frame_end(long pos) {
+    const char *k = s_script.keys;
+    long len = s_script.len;
+
+    if (k[pos] != 27 || pos + 1 == len) return pos + 1;
+    if (len - pos >= 6 && memcmp(k + pos, "\033[200~", 6) == 0) {
+        for (long i = pos + 6; i + 6 <= len; i++) {
+            if (memcmp(k + i, "\033[201~", 6) == 0) return i + 6;
+        }
+        return len;
+    }
+    if (k[pos + 1] == 'O') return pos + 3 < len ? pos + 3 : len;
+    if (k[pos + 1] != '[') return pos + 1;
+    long i = pos + 2;
+    while (i < len && !(k[i] >= 0x40 && k[i] <= 0x7E)) i++;
+    return i < len ? i + 1 : len;
+}
+
+/* Printable form of a frame's keys for the report */
+static void script_describe(long from, long to, char *dst, int size) {
+    int n = 0;
+    if (to - from > 8 && s_script.keys[from] == 27) {
+        snprintf(dst, size, "paste, %ld bytes", to - from);
+        return;
+    }
+    for (long i = from; i < to && n < size - 3; i++) {
+        unsigned char c = s_script.keys[i];
+        if (c == 27) n += snprintf(dst + n, size - n, "<esc>");
+        else if (c == '\r' || c == '\n') n += snprintf(dst + n, size - n, "<cr>");
+        else if (c < 32) n += snprintf(dst + n, size - n, "^%c", c + 64);
+        else dst[n++] = c;
+        if (n >= size) n = size - 1;
+    }
+    dst[n] = '\0';
+}
+
+static void script_run(long long t0) {
+    long frames = 0, bytes = 0, max_us = 0;
+    long long total_us = 0;
+    long mark = 0;
+    char desc[40] = "open";
+
+    printf("frame    bytes       us  keys\n");
+    for (;;) {
+        draw_screen();
+        long us = (long)(plat_time_us() - t0);
+        long n = s_out_total - mark;
+        printf("%5ld %8ld %8ld  %s\n", frames, n, us, desc);
+        frames++;
+        bytes += n;
+        total_us += us;
+        if (us > max_us) max_us = us;
+
+        if (s_script.pos >= s_script.len) break;
+        s_script.frame_end = script_frame_end(s_script.pos);
+        script_describe(s_script.pos, s_script.frame_end, desc, sizeof(desc));
+
+        t0 = plat_time_us();
+        mark = s_out_total;
+        while (E.running && input_fill() > 0) {
+            int key;
+            while (E.running && (key = input_next()) != KEY_NONE) {
+                process_key(key);
+            }
+        }
+        if (!E.running) break;
+    }
+    printf("total: %ld frames, %ld bytes, %ld bytes/frame, %ld us/frame, max %ld us\n",
+           frames, bytes, bytes / frames, (long)(total_us / frames), max_us);
+}
+
 /* ========== Main ========== */
 int main(int argc, char **argv) {
+    const char *path = NULL;
+    const char *script = NULL;
+
     /* Initialize editor state */
     memset(&E, 0, sizeof(E));
     E.running = 1;
     E.mode = MODE_NORMAL;
 
-    /* Platform init */
-    plat_init();
-    plat_get_size(&E.screen_rows, &E.screen_cols);
+#ifdef VI_BENCH
+    if (argc >= 2 && strcmp(argv[1], "--bench") == 0) return bench_main(argv[0]);
+#endif
+
+    int first_file = argc;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-L") == 0) {
+            s_lat.enabled = 1;
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            script = argv[++i];
+        } else if (!path) {
+            path = argv[i];
+            first_file = i;
+        }
+    }
 
-    /* Load file or create empty buffer */
-    if (argc >= 2) {
-        strncpy(E.filepath, argv[1], sizeof(E.filepath) - 1);
-        load_file(argv[1]);
+    /* Platform init, or a virtual screen for a replay */
+    if (script) {
+        if (!script_load(script)) {
+            fprintf(stderr, "vi: cannot read %s\n", script);
+            return 1;
+        }
+        s_out_fd = -1;
+        E.screen_rows = HEADLESS_ROWS;
+        E.screen_cols = HEADLESS_COLS;
     } else {
-        insert_line_at(0, "");
-        snprintf(E.status, sizeof(E.status), "[No Name]");
+        plat_init();
+        plat_get_size(&E.screen_rows, &E.screen_cols);
+    }
+    screen_init();
+    long long t0 = plat_time_us();
+
+    /* One buffer per file argument, or an empty one; show the first */
+    buf_edit(path);
+    for (int i = first_file + 1; i < argc; i++) {
+        if (strcmp(argv[i], "-L") == 0) continue;
+        if (strcmp(argv[i], "-s") == 0) {
+            i++;
+            continue;
+        }
+        buf_edit(argv[i]);
     }
+    if (s_buf_cur != 0) buf_switch(0);
 
     /* Clear screen */
     out_str(ESC_CLEAR);
     out_str(ESC_HOME);
     out_flush();
 
+    if (script) script_run(t0);
+
     /* Main loop */
-    while (E.running) {
+    int hung_up = 0;
+    while (E.running && !script) {
         draw_screen();
+        lat_painted();
 
-        int key = read_key();
-        if (key == KEY_NONE) {
-            plat_delay_ms(10);
-            continue;
+        /* Sleep until there is something to do; idle time flushes the swap */
+        int wait = PLAT_WAIT_MS;
+        if (s_swap_out.len && (wait < 0 || wait > SWAP_IDLE_MS)) wait = SWAP_IDLE_MS;
+        int ready = plat_wait_input(wait);
+        if (ready == 0) swap_idle();
+        if (plat_take_resize()) screen_resize();
+        int got = ready > 0 ? input_fill() : 0;
+        if (ready < 0 || got < 0) {     /* Terminal hung up */
+            hung_up = 1;
+            break;
         }
+        if (got == 0) continue;
+        lat_arrival();
 
-        switch (E.mode) {
-            case MODE_NORMAL:
-                handle_normal(key);
-                break;
-            case MODE_INSERT:
-                handle_insert(key);
-                break;
-            case MODE_COMMAND:
-                handle_command(key);
-                break;
-        }
+        /* Apply everything pending before the next redraw */
+        do {
+            int key;
+            while (E.running && (key = input_next()) != KEY_NONE) {
+                process_key(key);
+            }
+        } while (E.running && s_in.more && input_fill() > 0);
     }
 
     /* Cleanup */
@@ -811,8 +4478,15 @@ int main(int argc, char **argv) {
     out_str(ESC_RESET);
     out_flush();
 
-    free_all_lines();
-    plat_cleanup();
+    buf_close_all(hung_up);
+    regs_free();
+    free(s_ex_buf);
+    free(s_cmap.byte_col);
+    free(s_cmap.col_byte);
+    screen_free();
+    if (script) free(s_script.keys);
+    else plat_cleanup();
+    lat_report();
 
     return 0;
 }